@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+
+import os
+import re
+import sys
+import csv
+import json
+import time
+import random
+import argparse
+import subprocess
+
+
+def parse_size(size):
+    """Parses token counts like 10M or 1B."""
+    size = size.strip().upper()
+    multipliers = {'K': 10**3, 'M': 10**6, 'B': 10**9, 'G': 10**9}
+    if size[-1] in multipliers:
+        return int(float(size[:-1]) * multipliers[size[-1]])
+    return int(size)
+
+
+def parse_int_list(values):
+    return [int(v) for v in values.split(',') if v.strip()]
+
+
+def generate_corpus(fname, num_tokens, vocab_size, seed):
+    """Writes a synthetic corpus with Zipfian word frequencies and
+    Markov dependencies between consecutive words so that the
+    clustering has some structure to find."""
+    if os.path.exists(fname):
+        print("Using existing corpus %s" % fname, file=sys.stderr)
+        return
+
+    print("Generating corpus %s with %d tokens" % (fname, num_tokens), file=sys.stderr)
+    rng = random.Random(seed)
+    words = ["w%d" % i for i in range(vocab_size)]
+    zipf_weights = [1.0 / (i + 1) for i in range(vocab_size)]
+    cum_weights = []
+    total = 0.0
+    for w in zipf_weights:
+        total += w
+        cum_weights.append(total)
+
+    # Each word prefers a small set of followers, drawn from the same
+    # Zipfian distribution.
+    num_followers = 16
+    followers = [rng.choices(range(vocab_size), cum_weights=cum_weights, k=num_followers)
+                 for i in range(vocab_size)]
+
+    tmp_fname = fname + ".tmp"
+    written = 0
+    chunk = 1000000
+    with open(tmp_fname, "w") as outf:
+        while written < num_tokens:
+            n = min(chunk, num_tokens - written)
+            unigrams = rng.choices(range(vocab_size), cum_weights=cum_weights, k=n)
+            follow = rng.choices(range(num_followers), k=n)
+            sent_lengths = rng.choices(range(5, 30), k=n // 5 + 1)
+            lines = []
+            pos = 0
+            si = 0
+            while pos < n:
+                length = min(sent_lengths[si], n - pos)
+                si += 1
+                sent = [words[unigrams[pos]]]
+                for i in range(pos + 1, pos + length):
+                    if follow[i] < num_followers // 2:
+                        sent.append(words[followers[unigrams[i - 1]][follow[i]]])
+                    else:
+                        sent.append(words[unigrams[i]])
+                lines.append(" ".join(sent))
+                pos += length
+            outf.write("\n".join(lines))
+            outf.write("\n")
+            written += n
+    os.rename(tmp_fname, fname)
+
+
+def run_exchange(binary, corpus, model_base, num_classes, num_threads, max_iter):
+    """Runs exchange and collects per-iteration wall clock times,
+    peak resident set size and the final log likelihood."""
+    cmd = [binary,
+           "-c", str(num_classes),
+           "-t", str(num_threads),
+           "-a", str(max_iter),
+           "-m", "100000000",
+           "-w", "0",
+           corpus, model_base]
+    print(" ".join(cmd), file=sys.stderr)
+
+    start_time = time.monotonic()
+    proc = subprocess.Popen(cmd, stderr=subprocess.PIPE, universal_newlines=True)
+
+    iteration_starts = []
+    read_end_time = None
+    lls = []
+    for line in proc.stderr:
+        now = time.monotonic()
+        if line.startswith("Iteration "):
+            iteration_starts.append(now)
+        elif line.startswith("log likelihood:"):
+            lls.append(float(line.split(":")[1]))
+            if read_end_time is None:
+                read_end_time = now
+        elif line.startswith("Train run time:"):
+            iteration_starts.append(now)
+
+    _, status, rusage = os.wait4(proc.pid, 0)
+    end_time = time.monotonic()
+    if status != 0:
+        raise RuntimeError("exchange failed with status %d: %s" % (status, " ".join(cmd)))
+
+    iter_times = [iteration_starts[i + 1] - iteration_starts[i]
+                  for i in range(len(iteration_starts) - 1)]
+
+    # ru_maxrss is in kilobytes on Linux and in bytes on macOS
+    peak_rss_mb = rusage.ru_maxrss / 1024.0
+    if sys.platform == "darwin":
+        peak_rss_mb /= 1024.0
+
+    return {
+        "load_seconds": (read_end_time or end_time) - start_time,
+        "iteration_seconds": iter_times,
+        "mean_iteration_seconds": sum(iter_times) / len(iter_times) if iter_times else 0.0,
+        "total_seconds": end_time - start_time,
+        "peak_rss_mb": peak_rss_mb,
+        "final_log_likelihood": lls[-1] if lls else None,
+    }
+
+
+def write_report(results, fname):
+    if fname.endswith(".json"):
+        with open(fname, "w") as outf:
+            json.dump(results, outf, indent=2)
+        return
+
+    fields = ["build", "tokens", "classes", "threads", "load_seconds",
+              "mean_iteration_seconds", "total_seconds", "peak_rss_mb",
+              "final_log_likelihood", "speedup"]
+    with open(fname, "w") as outf:
+        writer = csv.DictWriter(outf, fieldnames=fields, extrasaction="ignore")
+        writer.writeheader()
+        for result in results:
+            writer.writerow(result)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Scaling benchmark for the exchange binary.')
+    parser.add_argument('--exchange', action="store", default="./exchange",
+                        help='Exchange binary to benchmark, default: ./exchange')
+    parser.add_argument('--compare', action="store", default=None,
+                        help='Another exchange binary to benchmark with the same settings')
+    parser.add_argument('--sizes', action="store", default="10M,100M,1B",
+                        help='Comma separated corpus sizes in tokens, default: 10M,100M,1B')
+    parser.add_argument('--classes', action="store", default="100,1000",
+                        help='Comma separated class counts (-c), default: 100,1000')
+    parser.add_argument('--threads', action="store", default="1,4",
+                        help='Comma separated thread counts (-t), default: 1,4')
+    parser.add_argument('--iterations', action="store", type=int, default=2,
+                        help='Number of exchange iterations per run, default: 2')
+    parser.add_argument('--vocab-size', action="store", type=int, default=100000,
+                        help='Vocabulary size of the generated corpora, default: 100000')
+    parser.add_argument('--work-dir', action="store", default="bench",
+                        help='Directory for generated corpora and models, default: bench')
+    parser.add_argument('--seed', action="store", type=int, default=1,
+                        help='Random seed for corpus generation, default: 1')
+    parser.add_argument('--report', action="store", default="bench_report.csv",
+                        help='Report file, .json for JSON and otherwise CSV, default: bench_report.csv')
+    args = parser.parse_args()
+
+    if not os.path.exists(args.work_dir):
+        os.makedirs(args.work_dir)
+
+    builds = [("current", args.exchange)]
+    if args.compare:
+        builds.append(("compare", args.compare))
+
+    results = []
+    for size in args.sizes.split(','):
+        num_tokens = parse_size(size)
+        corpus = os.path.join(args.work_dir, "corpus.%s.v%d.s%d.txt"
+                              % (size.strip(), args.vocab_size, args.seed))
+        generate_corpus(corpus, num_tokens, args.vocab_size, args.seed)
+
+        for num_classes in parse_int_list(args.classes):
+            for num_threads in parse_int_list(args.threads):
+                build_results = []
+                for build_name, binary in builds:
+                    model_base = os.path.join(args.work_dir, "model.%s.%s.c%d.t%d"
+                                              % (build_name, size.strip(), num_classes, num_threads))
+                    result = run_exchange(binary, corpus, model_base,
+                                          num_classes, num_threads, args.iterations)
+                    result.update({"build": build_name,
+                                   "binary": binary,
+                                   "tokens": num_tokens,
+                                   "classes": num_classes,
+                                   "threads": num_threads})
+                    build_results.append(result)
+
+                if len(build_results) > 1 and build_results[0]["mean_iteration_seconds"] > 0.0:
+                    for result in build_results[1:]:
+                        result["speedup"] = (result["mean_iteration_seconds"]
+                                             / build_results[0]["mean_iteration_seconds"])
+                for result in build_results:
+                    print("%s tokens=%d classes=%d threads=%d iter=%.2fs rss=%.1fMB ll=%s"
+                          % (result["build"], num_tokens, num_classes, num_threads,
+                             result["mean_iteration_seconds"], result["peak_rss_mb"],
+                             result["final_log_likelihood"]), file=sys.stderr)
+                results.extend(build_results)
+                write_report(results, args.report)
+
+    print("Wrote report to %s" % args.report, file=sys.stderr)
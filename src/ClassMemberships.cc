@@ -0,0 +1,188 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "ClassMemberships.hh"
+
+using namespace std;
+
+
+#define CLASS_MEMBERSHIPS_BINARY_MAGIC "CMEMBIN\0"
+#define CLASS_MEMBERSHIPS_BINARY_VERSION 1
+
+struct ClassMembershipsBinaryHeader {
+    char magic[8];
+    int32_t version;
+    int32_t num_classes;
+    int64_t num_words;
+    int64_t pool_bytes;
+};
+
+
+// Sections in the binary file are aligned to 8 bytes
+inline size_t
+section_size(size_t bytes)
+{
+    return bytes + (8 - bytes % 8) % 8;
+}
+
+
+inline void
+write_section(FILE *fp, const void *data, size_t bytes)
+{
+    static const char zeros[8] = { 0 };
+    size_t padding = section_size(bytes) - bytes;
+    if ((bytes > 0 && fwrite(data, 1, bytes, fp) != bytes)
+        || (padding > 0 && fwrite(zeros, 1, padding, fp) != padding))
+        throw string("Problem writing binary class memberships");
+}
+
+
+ClassMemberships::ClassMemberships()
+    : num_classes(0)
+{
+    clear();
+}
+
+
+void
+ClassMemberships::clear()
+{
+    num_classes = 0;
+    vector<int64_t>(1, 0).swap(m_offset_data);
+    vector<char>().swap(m_pool_data);
+    vector<int>().swap(m_class_data);
+    vector<float>().swap(m_log_prob_data);
+    m_mapped.reset();
+    set_pointers();
+}
+
+
+void
+ClassMemberships::set_pointers()
+{
+    m_num_words = m_class_data.size();
+    m_offsets = m_offset_data.data();
+    m_pool = m_pool_data.data();
+    m_classes = m_class_data.data();
+    m_log_probs = m_log_prob_data.data();
+}
+
+
+bool
+ClassMemberships::is_binary(string fname)
+{
+    FILE *fp = fopen(fname.c_str(), "rb");
+    if (fp == NULL) return false;
+    char magic[8];
+    bool binary = (fread(magic, 1, 8, fp) == 8
+                   && memcmp(magic, CLASS_MEMBERSHIPS_BINARY_MAGIC, 8) == 0);
+    fclose(fp);
+    return binary;
+}
+
+
+void
+ClassMemberships::read(string fname)
+{
+    clear();
+    if (is_binary(fname)) read_binary(fname);
+    else read_text(fname);
+}
+
+
+void
+ClassMemberships::read_text(string fname)
+{
+    SimpleFileInput wcf(fname);
+    string line;
+    int max_class = -1;
+    while (wcf.getline(line)) {
+        const char *ptr = line.c_str();
+        while (*ptr == ' ' || *ptr == '\t') ptr++;
+        const char *word_end = ptr;
+        while (*word_end != '\0' && *word_end != ' ' && *word_end != '\t') word_end++;
+        if (word_end == ptr) continue;
+
+        char *class_end;
+        long int clss = strtol(word_end, &class_end, 10);
+        if (class_end == word_end)
+            throw string("Invalid class membership line: " + line);
+        // The class initialization files may leave out the probabilities
+        float prob = strtof(class_end, NULL);
+
+        m_pool_data.insert(m_pool_data.end(), ptr, word_end);
+        m_pool_data.push_back('\0');
+        m_offset_data.push_back(m_pool_data.size());
+        m_class_data.push_back(clss);
+        m_log_prob_data.push_back(prob);
+        max_class = std::max(max_class, (int)clss);
+    }
+    num_classes = max_class+1;
+    set_pointers();
+}
+
+
+void
+ClassMemberships::read_binary(string fname)
+{
+    const string format_error("Invalid binary class memberships: " + fname);
+
+    m_mapped = make_shared<MemoryMappedFile>(fname);
+    const char *data = m_mapped->data();
+    size_t size = m_mapped->size();
+
+    if (size < sizeof(ClassMembershipsBinaryHeader)) throw format_error;
+    ClassMembershipsBinaryHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, CLASS_MEMBERSHIPS_BINARY_MAGIC, 8) != 0
+        || header.version != CLASS_MEMBERSHIPS_BINARY_VERSION
+        || header.num_words < 0 || header.num_words > INT32_MAX
+        || header.pool_bytes < 0)
+        throw format_error;
+
+    size_t offset = section_size(sizeof(header));
+    size_t offsets_bytes = section_size((header.num_words+1)*sizeof(int64_t));
+    size_t classes_bytes = section_size(header.num_words*sizeof(int));
+    size_t probs_bytes = section_size(header.num_words*sizeof(float));
+    if (size < offset + offsets_bytes + classes_bytes + probs_bytes + header.pool_bytes)
+        throw format_error;
+
+    num_classes = header.num_classes;
+    m_num_words = header.num_words;
+    m_offsets = reinterpret_cast<const int64_t*>(data + offset);
+    offset += offsets_bytes;
+    m_classes = reinterpret_cast<const int*>(data + offset);
+    offset += classes_bytes;
+    m_log_probs = reinterpret_cast<const float*>(data + offset);
+    offset += probs_bytes;
+    m_pool = data + offset;
+
+    if (m_offsets[0] != 0 || m_offsets[m_num_words] != header.pool_bytes)
+        throw format_error;
+
+    cerr << "Mapped binary class memberships with " << m_num_words << " words" << endl;
+}
+
+
+void
+ClassMemberships::write_binary(string fname) const
+{
+    ClassMembershipsBinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CLASS_MEMBERSHIPS_BINARY_MAGIC, 8);
+    header.version = CLASS_MEMBERSHIPS_BINARY_VERSION;
+    header.num_classes = num_classes;
+    header.num_words = m_num_words;
+    header.pool_bytes = m_offsets[m_num_words];
+
+    FILE *fp = fopen(fname.c_str(), "wb");
+    if (fp == NULL) throw string("Could not open file for writing: " + fname);
+    write_section(fp, &header, sizeof(header));
+    write_section(fp, m_offsets, (m_num_words+1)*sizeof(int64_t));
+    write_section(fp, m_classes, m_num_words*sizeof(int));
+    write_section(fp, m_log_probs, m_num_words*sizeof(float));
+    write_section(fp, m_pool, header.pool_bytes);
+    if (fclose(fp) != 0) throw string("Problem writing binary class memberships");
+}
@@ -0,0 +1,60 @@
+#ifndef CLASS_MEMBERSHIPS
+#define CLASS_MEMBERSHIPS
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "io.hh"
+
+
+/** Word classes and class membership log probabilities.
+ *
+ * Reads the text format written by exchange, one "word class logprob"
+ * entry per line, or a binary file written with write_binary. The
+ * binary file stores the words in a string pool and the classes and
+ * probabilities in flat arrays, it is memory mapped without parsing.
+ * The format is detected from the beginning of the file.
+ */
+class ClassMemberships {
+public:
+    ClassMemberships();
+
+    void read(std::string fname);
+    void write_binary(std::string fname) const;
+    static bool is_binary(std::string fname);
+    void clear();
+
+    int size() const { return m_num_words; }
+    std::string word(int idx) const {
+        return std::string(m_pool + m_offsets[idx], m_offsets[idx+1]-m_offsets[idx]-1);
+    }
+    int word_class(int idx) const { return m_classes[idx]; }
+    float log_prob(int idx) const { return m_log_probs[idx]; }
+
+    // Largest class index plus one
+    int num_classes;
+
+private:
+    ClassMemberships(const ClassMemberships&);
+    ClassMemberships& operator=(const ClassMemberships&);
+    void read_text(std::string fname);
+    void read_binary(std::string fname);
+    void set_pointers();
+
+    std::vector<int64_t> m_offset_data;
+    std::vector<char> m_pool_data;
+    std::vector<int> m_class_data;
+    std::vector<float> m_log_prob_data;
+    std::shared_ptr<MemoryMappedFile> m_mapped;
+
+    int64_t m_num_words;
+    const int64_t *m_offsets;
+    const char *m_pool;
+    const int *m_classes;
+    const float *m_log_probs;
+};
+
+
+#endif /* CLASS_MEMBERSHIPS */
@@ -6,24 +6,225 @@
 #include <functional>
 #include <iterator>
 #include <algorithm>
+#include <cctype>
+#include <unordered_map>
+#include <queue>
+#include <cstdint>
+#include <cstdio>
+#include <climits>
 
 #include "ExchangeAlgorithm.hh"
 #include "io.hh"
 #include "defs.hh"
+#include "ClassMemberships.hh"
+#include "parallel.hh"
 
 using namespace std;
 
 
+// Reads the next whitespace separated token of a line span
+static inline bool
+next_token(const char *&ptr, const char *end, string &token)
+{
+    while (ptr < end && isspace((unsigned char)*ptr)) ptr++;
+    if (ptr == end) return false;
+    const char *token_start = ptr;
+    while (ptr < end && !isspace((unsigned char)*ptr)) ptr++;
+    token.assign(token_start, ptr-token_start);
+    return true;
+}
+
+
+#define MIN_COUNT_BUFFER 4194304
+
+// Counts bigrams packed to 64-bit keys which sort by the first and
+// then the second word. Keys are collected to a buffer which is
+// sorted and added to the sorted counts when it is full. The buffer
+// grows with the counts, so each key is merged a few times. If the
+// buffer, the counts and the merged counts would not fit in the
+// memory budget together, the counts are first written to a temporary
+// file as a sorted run. The runs are merged at the end, the merge can
+// be repeated to pass over the counts more than once.
+class BigramCounter {
+public:
+    BigramCounter(size_t memory_budget);
+    ~BigramCounter();
+    void add(int w1, int w2) {
+        m_buffer.push_back(((uint64_t)w1 << 32) | (uint32_t)w2);
+        if (m_buffer.size() == m_buffer.capacity()) flush_buffer();
+    }
+    // Sorts the remaining counts, no bigrams can be added after this
+    void finish();
+    // Calls add_count(w1, w2, count) for all bigrams in sorted order
+    void merge(function<void(int, int, int64_t)> add_count);
+    int num_runs() const { return m_runs.size(); }
+
+private:
+    struct Count {
+        uint64_t bigram;
+        int64_t count;
+    };
+    struct RunReader {
+        FILE *fp;
+        vector<Count> buffer;
+        size_t pos;
+        size_t size;
+        bool next();
+    };
+
+    void flush_buffer();
+    void write_run();
+    void reserve_buffer(size_t size);
+
+    size_t m_memory_budget;
+    size_t m_max_buffer;
+    vector<uint64_t> m_buffer;
+    vector<Count> m_counts;
+    vector<FILE*> m_runs;
+};
+
+
+BigramCounter::BigramCounter(size_t memory_budget)
+    : m_memory_budget(memory_budget)
+{
+    // A full buffer of distinct keys is merged to as many counts
+    m_max_buffer = std::max((size_t)1, memory_budget / (sizeof(uint64_t) + sizeof(Count)));
+    reserve_buffer(MIN_COUNT_BUFFER);
+}
+
+
+// The buffer is reallocated only when empty so that the old and new
+// allocations do not coexist
+void
+BigramCounter::reserve_buffer(size_t size)
+{
+    size = std::min(std::max(size, (size_t)MIN_COUNT_BUFFER), m_max_buffer);
+    if (size == m_buffer.capacity()) return;
+    vector<uint64_t>().swap(m_buffer);
+    m_buffer.reserve(size);
+}
+
+
+BigramCounter::~BigramCounter()
+{
+    for (auto rit = m_runs.begin(); rit != m_runs.end(); ++rit)
+        fclose(*rit);
+}
+
+
+void
+BigramCounter::flush_buffer()
+{
+    if (m_buffer.empty()) return;
+    sort(m_buffer.begin(), m_buffer.end());
+
+    size_t merge_memory = m_buffer.capacity()*sizeof(uint64_t)
+        + (2*m_counts.size() + m_buffer.size())*sizeof(Count);
+    if (m_counts.size() > 0 && merge_memory > m_memory_budget) write_run();
+
+    // Merges the sorted buffer to the sorted counts
+    vector<Count> merged;
+    merged.reserve(m_counts.size() + m_buffer.size());
+    auto cit = m_counts.begin();
+    for (auto bit = m_buffer.begin(); bit != m_buffer.end();) {
+        uint64_t bigram = *bit;
+        int64_t count = 0;
+        for (; bit != m_buffer.end() && *bit == bigram; ++bit) count++;
+        for (; cit != m_counts.end() && cit->bigram < bigram; ++cit) merged.push_back(*cit);
+        if (cit != m_counts.end() && cit->bigram == bigram) count += (cit++)->count;
+        Count entry = { bigram, count };
+        merged.push_back(entry);
+    }
+    merged.insert(merged.end(), cit, m_counts.end());
+    m_counts.swap(merged);
+    vector<Count>().swap(merged);
+    m_buffer.clear();
+    reserve_buffer(m_counts.size());
+}
+
+
+void
+BigramCounter::write_run()
+{
+    FILE *fp = tmpfile();
+    if (fp == NULL) throw string("Could not create a temporary file for bigram counts");
+    m_runs.push_back(fp);
+    if (m_counts.size() > 0 && fwrite(m_counts.data(), sizeof(Count), m_counts.size(), fp) != m_counts.size())
+        throw string("Problem writing bigram counts to a temporary file");
+    vector<Count>().swap(m_counts);
+}
+
+
+bool
+BigramCounter::RunReader::next()
+{
+    if (++pos < size) return true;
+    size = fread(buffer.data(), sizeof(Count), buffer.size(), fp);
+    pos = 0;
+    if (size == 0 && ferror(fp))
+        throw string("Problem reading bigram counts from a temporary file");
+    return size > 0;
+}
+
+
+void
+BigramCounter::finish()
+{
+    flush_buffer();
+    vector<uint64_t>().swap(m_buffer);
+    if (m_runs.size() > 0 && m_counts.size() > 0) write_run();
+}
+
+
+void
+BigramCounter::merge(function<void(int, int, int64_t)> add_count)
+{
+    if (m_runs.empty()) {
+        for (auto cit = m_counts.begin(); cit != m_counts.end(); ++cit)
+            add_count(cit->bigram >> 32, cit->bigram & 0xffffffff, cit->count);
+        return;
+    }
+
+    // k-way merge of the sorted runs, the read buffers share the memory budget
+    size_t buffer_size = std::max((size_t)4096, m_memory_budget / sizeof(Count) / m_runs.size());
+    vector<RunReader> readers(m_runs.size());
+    typedef pair<uint64_t, int> HeapItem;
+    priority_queue<HeapItem, vector<HeapItem>, greater<HeapItem> > heap;
+    for (unsigned int r=0; r<m_runs.size(); r++) {
+        readers[r].fp = m_runs[r];
+        rewind(m_runs[r]);
+        readers[r].buffer.resize(buffer_size);
+        readers[r].pos = 0;
+        readers[r].size = 0;
+        if (readers[r].next()) heap.push(make_pair(readers[r].buffer[0].bigram, r));
+    }
+
+    while (!heap.empty()) {
+        uint64_t bigram = heap.top().first;
+        int64_t count = 0;
+        while (!heap.empty() && heap.top().first == bigram) {
+            RunReader &reader = readers[heap.top().second];
+            int r = heap.top().second;
+            heap.pop();
+            count += reader.buffer[reader.pos].count;
+            if (reader.next()) heap.push(make_pair(reader.buffer[reader.pos].bigram, r));
+        }
+        add_count(bigram >> 32, bigram & 0xffffffff, count);
+    }
+}
+
+
 Exchange::Exchange(int num_classes,
                    string fname,
                    string vocab_fname,
                    string class_fname,
-                   unsigned int top_word_classes)
+                   unsigned int top_word_classes,
+                   size_t count_memory)
     : m_num_classes(num_classes+2)
 {
     m_num_special_classes = 2;
     if (fname.length()) {
-        read_corpus(fname, vocab_fname);
+        read_corpus(fname, vocab_fname, count_memory);
         if (class_fname.length())
             read_class_initialization(class_fname);
         else
@@ -35,17 +236,19 @@ Exchange::Exchange(int num_classes,
 
 void
 Exchange::read_corpus(string fname,
-                      string vocab_fname)
+                      string vocab_fname,
+                      size_t count_memory)
 {
-    string line;
+    string line, token;
+    const char *data;
+    size_t size;
 
     cerr << "Reading vocabulary..";
     set<string> word_types;
     SimpleFileInput corpusf(fname);
-    while (corpusf.getline(line)) {
-        stringstream ss(line);
-        string token;
-        while (ss >> token) word_types.insert(token);
+    while (corpusf.getline(data, size)) {
+        const char *end = data + size;
+        while (next_token(data, end, token)) word_types.insert(token);
     }
 
     if (vocab_fname.length()) {
@@ -81,22 +284,21 @@ Exchange::read_corpus(string fname,
 
     cerr << "Reading word counts..";
     m_word_counts.resize(m_vocabulary.size());
-    m_word_bigram_counts.resize(m_vocabulary.size());
-    m_word_rev_bigram_counts.resize(m_vocabulary.size());
 
     int ss_idx = m_vocabulary_lookup["<s>"];
     int se_idx = m_vocabulary_lookup["</s>"];
     int unk_idx = m_vocabulary_lookup["<unk>"];
 
-    int num_tokens = 0;
+    long int num_tokens = 0;
+    vector<int> sent;
+    BigramCounter bigram_counter(count_memory);
     SimpleFileInput corpusf2(fname);
-    while (corpusf2.getline(line)) {
-        vector<int> sent;
-        stringstream ss(line);
-        string token;
+    while (corpusf2.getline(data, size)) {
+        const char *end = data + size;
+        sent.clear();
 
         sent.push_back(ss_idx);
-        while (ss >> token) {
+        while (next_token(data, end, token)) {
             if (token == "<s>" || token == "</s>") continue;
             if (token == "<unk>" || token == "<UNK>") {
                 sent.push_back(unk_idx);
@@ -111,32 +313,114 @@ Exchange::read_corpus(string fname,
 
         for (unsigned int i=0; i<sent.size(); i++)
             m_word_counts[sent[i]]++;
-        for (unsigned int i=0; i<sent.size()-1; i++) {
-            m_word_bigram_counts[sent[i]][sent[i+1]]++;
-            m_word_rev_bigram_counts[sent[i+1]][sent[i]]++;
-        }
+        for (unsigned int i=0; i<sent.size()-1; i++)
+            bigram_counter.add(sent[i], sent[i+1]);
         num_tokens += sent.size()-2;
     }
     cerr << " " << num_tokens << " tokens" << endl;
+
+    bigram_counter.finish();
+    if (bigram_counter.num_runs() > 0)
+        cerr << "Merging " << bigram_counter.num_runs() << " sorted runs of bigram counts" << endl;
+
+    // The first merge sizes the rows and the second fills them. The
+    // bigrams come sorted by the first word and then the second word,
+    // so both the forward and the reverse rows are sorted.
+    vector<int64_t> &starts = m_word_bigram_counts.starts;
+    vector<int64_t> &rev_starts = m_word_rev_bigram_counts.starts;
+    starts.assign(m_vocabulary.size()+1, 0);
+    rev_starts.assign(m_vocabulary.size()+1, 0);
+    bigram_counter.merge([&](int w1, int w2, int64_t count) {
+        if (count > INT_MAX) throw string("Bigram count does not fit in an int");
+        starts[w1+1]++;
+        rev_starts[w2+1]++;
+    });
+    for (unsigned int i=1; i<starts.size(); i++) {
+        starts[i] += starts[i-1];
+        rev_starts[i] += rev_starts[i-1];
+    }
+
+    m_word_bigram_counts.entries.resize(starts.back());
+    m_word_rev_bigram_counts.entries.resize(rev_starts.back());
+    vector<int64_t> pos(starts.begin(), starts.end()-1);
+    vector<int64_t> rev_pos(rev_starts.begin(), rev_starts.end()-1);
+    bigram_counter.merge([&](int w1, int w2, int64_t count) {
+        m_word_bigram_counts.entries[pos[w1]++] = make_pair(w2, (int)count);
+        m_word_rev_bigram_counts.entries[rev_pos[w2]++] = make_pair(w1, (int)count);
+    });
 }
 
 
 void
 Exchange::write_class_mem_probs(string fname) const
+{
+    write_class_mem_probs(fname, m_word_classes, m_class_counts);
+}
+
+
+void
+Exchange::write_class_mem_probs(string fname,
+                                const vector<int> &word_classes,
+                                const vector<int> &class_counts) const
 {
     SimpleFileOutput mfo(fname);
     for (unsigned int widx = 0; widx < m_vocabulary.size(); widx++) {
         const string &word = m_vocabulary[widx];
         if (word == "<s>" || word == "</s>" || word == "<unk>") continue;
         double lp = log(m_word_counts[widx]);
-        lp -= log(m_class_counts[m_word_classes[widx]]);
-        mfo << word << "\t" << m_word_classes[widx]-m_num_special_classes
+        lp -= log(class_counts[word_classes[widx]]);
+        mfo << word << "\t" << word_classes[widx]-m_num_special_classes
             << " " << lp << "\n";
     }
     mfo.close();
 }
 
 
+// Writes a model snapshot taken during the training and removes
+// the oldest kept model, run in a background thread
+void
+Exchange::write_temp_model(string fname,
+                           string old_fname,
+                           const vector<int> &word_classes,
+                           const vector<int> &class_counts,
+                           exception_ptr &error) const
+{
+    try {
+        write_class_mem_probs(fname, word_classes, class_counts);
+        if (old_fname.length() > 0) remove(old_fname.c_str());
+    } catch (...) {
+        error = current_exception();
+    }
+}
+
+
+void
+Exchange::write_class_corpus(string corpus_fname,
+                             string class_corpus_fname,
+                             string unk,
+                             int num_threads) const
+{
+    unordered_map<string, string> word_classes;
+    word_classes.reserve(m_vocabulary.size());
+    for (unsigned int widx = 0; widx < m_vocabulary.size(); widx++) {
+        const string &word = m_vocabulary[widx];
+        if (word == "<s>" || word == "</s>" || word == "<unk>") continue;
+        word_classes[word] = int2str(m_word_classes[widx]-m_num_special_classes);
+    }
+
+    SimpleFileInput corpusf(corpus_fname);
+    SimpleFileOutput classf(class_corpus_fname);
+    ClassBatch total(&classf);
+    process_lines<ClassBatch>(corpusf, num_threads,
+        [&](const vector<string> &lines, ClassBatch &batch, int thread_idx) {
+            for (auto lit = lines.begin(); lit != lines.end(); ++lit)
+                append_class_sentence(batch.text, *lit, word_classes, unk);
+        },
+        total, 10000);
+    classf.close();
+}
+
+
 void
 Exchange::initialize_classes_by_freq(unsigned int top_word_classes)
 {
@@ -198,15 +482,11 @@ Exchange::read_class_initialization(string class_fname)
     m_classes[START_CLASS].insert(eos_idx);
     m_classes[UNK_CLASS].insert(unk_idx);
 
-    SimpleFileInput classf(class_fname);
-    string line;
+    ClassMemberships class_memberships;
+    class_memberships.read(class_fname);
     map<int, int> file_to_class_idx;
-    while (classf.getline(line)) {
-        if (!line.length()) continue;
-        stringstream ss(line);
-
-        string word;
-        ss >> word;
+    for (int i=0; i<class_memberships.size(); i++) {
+        string word = class_memberships.word(i);
         if (word == "<s>" || word == "</s>" || word == "<unk>") {
             cerr << "Warning: You have specified special tokens in the class "
                  << "initialization file. These will be ignored." << endl;
@@ -216,8 +496,8 @@ Exchange::read_class_initialization(string class_fname)
         if (vlit == m_vocabulary_lookup.end()) continue;
         int widx = vlit->second;
 
-        int file_idx, class_idx;
-        ss >> file_idx;
+        int file_idx = class_memberships.word_class(i);
+        int class_idx;
         auto cit = file_to_class_idx.find(file_idx);
         if (cit != file_to_class_idx.end()) {
             class_idx = cit->second;
@@ -260,10 +540,9 @@ Exchange::set_class_counts()
 
     for (unsigned int i=0; i<m_word_counts.size(); i++)
         m_class_counts[m_word_classes[i]] += m_word_counts[i];
-    for (unsigned int i=0; i<m_word_bigram_counts.size(); i++) {
+    for (int i=0; i<m_word_bigram_counts.num_rows(); i++) {
         int src_class = m_word_classes[i];
-        map<int, int> &curr_bigram_ctxt = m_word_bigram_counts[i];
-        for (auto bgit = curr_bigram_ctxt.begin(); bgit != curr_bigram_ctxt.end(); ++bgit) {
+        for (auto bgit = m_word_bigram_counts.begin(i); bgit != m_word_bigram_counts.end(i); ++bgit) {
             int tgt_class = m_word_classes[bgit->first];
             m_class_bigram_counts[src_class][tgt_class] += bgit->second;
             m_class_word_counts[bgit->first][src_class] += bgit->second;
@@ -318,7 +597,6 @@ Exchange::evaluate_exchange(int word,
 {
     double ll_diff = 0.0;
     int wc = m_word_counts[word];
-    const map<int, int> &wb_ctxt = m_word_bigram_counts.at(word);
     const map<int, int> &cw_counts = m_class_word_counts.at(word);
     const map<int, int> &wc_counts = m_word_class_counts.at(word);
 
@@ -353,9 +631,7 @@ Exchange::evaluate_exchange(int word,
         evaluate_ll_diff(ll_diff, curr_count, new_count);
     }
 
-    int self_count = 0;
-    auto scit = wb_ctxt.find(word);
-    if (scit != wb_ctxt.end()) self_count = scit->second;
+    int self_count = m_word_bigram_counts.count(word, word);
 
     int curr_count = m_class_bigram_counts[curr_class][tentative_class];
     int new_count = curr_count - get_count(wc_counts, tentative_class)
@@ -390,8 +666,7 @@ Exchange::do_exchange(int word,
     m_class_counts[prev_class] -= wc;
     m_class_counts[new_class] += wc;
 
-    map<int, int> &bctxt = m_word_bigram_counts[word];
-    for (auto wit = bctxt.begin(); wit != bctxt.end(); ++wit) {
+    for (auto wit = m_word_bigram_counts.begin(word); wit != m_word_bigram_counts.end(word); ++wit) {
         if (wit->first == word) continue;
         int tgt_class = m_word_classes[wit->first];
         m_class_bigram_counts[prev_class][tgt_class] -= wit->second;
@@ -400,8 +675,7 @@ Exchange::do_exchange(int word,
         m_class_word_counts[wit->first][new_class] += wit->second;
     }
 
-    map<int, int> &rbctxt = m_word_rev_bigram_counts[word];
-    for (auto wit = rbctxt.begin(); wit != rbctxt.end(); ++wit) {
+    for (auto wit = m_word_rev_bigram_counts.begin(word); wit != m_word_rev_bigram_counts.end(word); ++wit) {
         if (wit->first == word) continue;
         int src_class = m_word_classes[wit->first];
         m_class_bigram_counts[src_class][prev_class] -= wit->second;
@@ -410,14 +684,14 @@ Exchange::do_exchange(int word,
         m_word_class_counts[wit->first][new_class] += wit->second;
     }
 
-    auto wit = bctxt.find(word);
-    if (wit != bctxt.end()) {
-        m_class_bigram_counts[prev_class][prev_class] -= wit->second;
-        m_class_bigram_counts[new_class][new_class] += wit->second;
-        m_class_word_counts[word][prev_class] -= wit->second;
-        m_class_word_counts[word][new_class] += wit->second;
-        m_word_class_counts[word][prev_class] -= wit->second;
-        m_word_class_counts[word][new_class] += wit->second;
+    int self_count = m_word_bigram_counts.count(word, word);
+    if (self_count != 0) {
+        m_class_bigram_counts[prev_class][prev_class] -= self_count;
+        m_class_bigram_counts[new_class][new_class] += self_count;
+        m_class_word_counts[word][prev_class] -= self_count;
+        m_class_word_counts[word][new_class] += self_count;
+        m_word_class_counts[word][prev_class] -= self_count;
+        m_word_class_counts[word][new_class] += self_count;
     }
 
     m_classes[prev_class].erase(word);
@@ -432,12 +706,27 @@ Exchange::iterate(int max_iter,
                   int ll_print_interval,
                   int model_write_interval,
                   string model_base,
-                  int num_threads)
+                  int num_threads,
+                  string model_suffix,
+                  int keep_models)
 {
     time_t start_time = time(0);
     time_t last_model_write_time = start_time;
     int tmp_model_idx = 1;
 
+    // The training continues while the previous model is written,
+    // a failed write is rethrown when the writer is joined
+    thread model_writer;
+    exception_ptr writer_error;
+    struct WriterJoin {
+        thread &writer;
+        ~WriterJoin() { if (writer.joinable()) writer.join(); }
+    } writer_join = { model_writer };
+    auto join_writer = [&]() {
+        if (model_writer.joinable()) model_writer.join();
+        if (writer_error) rethrow_exception(writer_error);
+    };
+
     int curr_iter = 0;
     while (true) {
         cerr << "Iteration " << curr_iter+1 << endl;
@@ -487,12 +776,19 @@ Exchange::iterate(int max_iter,
             if (widx % 1000 == 0) {
                 time_t curr_time = time(0);
 
-                if (curr_time-start_time > max_seconds)
+                if (curr_time-start_time > max_seconds) {
+                    join_writer();
                     return log_likelihood();
+                }
 
                 if (model_write_interval > 0 && curr_time-last_model_write_time > model_write_interval) {
-                    string temp_base = model_base + ".temp" + int2str(tmp_model_idx);
-                    write_class_mem_probs(temp_base + ".cmemprobs.gz");
+                    join_writer();
+                    string temp_fname = model_base + ".temp" + int2str(tmp_model_idx) + model_suffix;
+                    string old_fname;
+                    if (keep_models > 0 && tmp_model_idx > keep_models)
+                        old_fname = model_base + ".temp" + int2str(tmp_model_idx-keep_models) + model_suffix;
+                    model_writer = thread(&Exchange::write_temp_model, this, temp_fname, old_fname,
+                                          m_word_classes, m_class_counts, ref(writer_error));
                     last_model_write_time = curr_time;
                     tmp_model_idx++;
                 }
@@ -500,7 +796,10 @@ Exchange::iterate(int max_iter,
         }
 
         curr_iter++;
-        if (max_iter > 0 && curr_iter >= max_iter) return log_likelihood();
+        if (max_iter > 0 && curr_iter >= max_iter) {
+            join_writer();
+            return log_likelihood();
+        }
     }
 }
 
@@ -1,13 +1,41 @@
 #ifndef EXCHANGE
 #define EXCHANGE
 
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #define START_CLASS 0
 #define UNK_CLASS 1
+#define DEFAULT_COUNT_MEMORY 2147483648UL
+
+
+/** Sorted (word, count) pairs of all words in one array. The pairs of
+ *  word w are from starts[w] up to starts[w+1]. */
+class WordCountRows {
+public:
+    typedef std::pair<int, int> Entry;
+    int num_rows() const { return starts.size() > 0 ? starts.size()-1 : 0; }
+    const Entry* begin(int w) const { return entries.data() + starts[w]; }
+    const Entry* end(int w) const { return entries.data() + starts[w+1]; }
+    int count(int w, int w2) const {
+        const Entry *it = std::lower_bound(begin(w), end(w), Entry(w2, INT_MIN));
+        return (it != end(w) && it->first == w2) ? it->second : 0;
+    }
+    bool operator==(const WordCountRows &other) const {
+        return starts == other.starts && entries == other.entries;
+    }
+
+    std::vector<int64_t> starts;
+    std::vector<Entry> entries;
+};
 
 
 class Exchange {
@@ -16,12 +44,19 @@ public:
              std::string fname="",
              std::string vocab_fname="",
              std::string class_fname="",
-             unsigned int top_word_classes=0);
+             unsigned int top_word_classes=0,
+             size_t count_memory=DEFAULT_COUNT_MEMORY);
     ~Exchange() { };
 
+    // Bigram counts exceeding count_memory bytes are merged via temporary files
     void read_corpus(std::string fname,
-                     std::string vocab_fname="");
+                     std::string vocab_fname="",
+                     size_t count_memory=DEFAULT_COUNT_MEMORY);
     void write_class_mem_probs(std::string fname) const;
+    void write_class_corpus(std::string corpus_fname,
+                            std::string class_corpus_fname,
+                            std::string unk="<unk>",
+                            int num_threads=1) const;
     void initialize_classes_by_freq(unsigned int top_word_classes=0);
     void read_class_initialization(std::string class_fname);
     void set_class_counts();
@@ -37,7 +72,9 @@ public:
                    int ll_print_interval=0,
                    int model_write_interval=0,
                    std::string model_base="",
-                   int num_threads=1);
+                   int num_threads=1,
+                   std::string model_suffix=".cmemprobs.gz",
+                   int keep_models=0);
 
     void evaluate_thr(int num_threads,
                       int word_index,
@@ -53,6 +90,15 @@ public:
 
 private:
 
+    void write_class_mem_probs(std::string fname,
+                               const std::vector<int> &word_classes,
+                               const std::vector<int> &class_counts) const;
+    void write_temp_model(std::string fname,
+                          std::string old_fname,
+                          const std::vector<int> &word_classes,
+                          const std::vector<int> &class_counts,
+                          std::exception_ptr &error) const;
+
     int m_num_classes;
     int m_num_special_classes;
 
@@ -63,8 +109,8 @@ private:
     std::vector<int> m_word_classes;
 
     std::vector<int> m_word_counts;
-    std::vector<std::map<int, int> > m_word_bigram_counts;
-    std::vector<std::map<int, int> > m_word_rev_bigram_counts;
+    WordCountRows m_word_bigram_counts;
+    WordCountRows m_word_rev_bigram_counts;
 
     std::vector<int> m_class_counts;
     std::vector<std::vector<int> > m_class_bigram_counts;
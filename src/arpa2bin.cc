@@ -0,0 +1,37 @@
+#include <iostream>
+#include <string>
+
+#include "conf.hh"
+#include "Ngram.hh"
+
+using namespace std;
+
+
+int main(int argc, char* argv[])
+{
+    try {
+        conf::Config config;
+        config("usage: arpa2bin [OPTION...] ARPAFILE BINFILE\n")
+        ('l', "log10", "", "", "Store log10 probabilities, DEFAULT: natural logarithm as used by the perplexity tools")
+        ('q', "quantize=INT", "arg", "", "Store probabilities quantized to INT bits (1-16) in the compact model representation")
+        ('h', "help", "", "", "display help");
+        config.default_parse(argc, argv);
+        if (config.arguments.size() != 2) config.print_help(stderr, 1);
+
+        string arpafname = config.arguments[0];
+        string binfname = config.arguments[1];
+
+        Ngram log10lm;
+        LNNgram lnlm;
+        Ngram &lm = config["log10"].specified ? log10lm : lnlm;
+        lm.read_arpa(arpafname);
+        if (config["quantize"].specified) lm.quantize(config["quantize"].get_int());
+        lm.write_binary(binfname);
+
+        exit(EXIT_SUCCESS);
+
+    } catch (string &e) {
+        cerr << e << endl;
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "str.hh"
+#include "defs.hh"
+#include "ClassMemberships.hh"
+#include "io.hh"
+#include "conf.hh"
+#include "parallel.hh"
+
+using namespace std;
+
+
+int main(int argc, char* argv[])
+{
+    try {
+        conf::Config config;
+        config("usage: class_corpus [OPTION...] CLASS_MEMBERSHIPS [INPUT [OUTPUT]]\n"
+               "Converts a text corpus to corresponding class sequences.\n"
+               "INPUT and OUTPUT default to standard input and output (-), .gz supported.\n")
+        ('C', "cap_unk", "", "", "Unk symbol should be written in capitals i.e. <UNK>")
+        ('L', "lc_unk", "", "", "Unk symbol should be written in lowercase i.e. <unk>")
+        ('t', "num-threads=INT", "arg", "1", "Number of threads, default: 1")
+        ('h', "help", "", "", "display help");
+        config.default_parse(argc, argv);
+        if (config.arguments.size() < 1 || config.arguments.size() > 3) config.print_help(stderr, 1);
+
+        string unk;
+        if (config["cap_unk"].specified) unk = "<UNK>";
+        else if (config["lc_unk"].specified) unk = "<unk>";
+        else throw string("Define either cap_unk or lc_unk option");
+
+        string classmfname = config.arguments[0];
+        string infname = config.arguments.size() > 1 ? config.arguments[1] : "-";
+        string outfname = config.arguments.size() > 2 ? config.arguments[2] : "-";
+        int num_threads = config["num-threads"].get_int();
+
+        ClassMemberships class_memberships;
+        class_memberships.read(classmfname);
+        unordered_map<string, string> word_classes;
+        word_classes.reserve(class_memberships.size());
+        for (int i=0; i<class_memberships.size(); i++)
+            word_classes[class_memberships.word(i)] = int2str(class_memberships.word_class(i));
+        class_memberships.clear();
+
+        ios_base::sync_with_stdio(false);
+        SimpleFileInput infile(infname);
+        SimpleFileOutput outfile(outfname);
+        ClassBatch total(&outfile);
+        process_lines<ClassBatch>(infile, num_threads,
+            [&](const vector<string> &lines, ClassBatch &batch, int thread_idx) {
+                for (auto lit = lines.begin(); lit != lines.end(); ++lit)
+                    append_class_sentence(batch.text, *lit, word_classes, unk);
+            },
+            total, 10000);
+        outfile.close();
+
+        exit(EXIT_SUCCESS);
+
+    } catch (string &e) {
+        cerr << e << endl;
+        exit(EXIT_FAILURE);
+    }
+}
@@ -3,125 +3,185 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "str.hh"
 #include "defs.hh"
+#include "ClassMemberships.hh"
 #include "conf.hh"
+#include "parallel.hh"
 #include "Ngram.hh"
 
 using namespace std;
 
 
-void preprocess_sent(string line,
-                     const Ngram &lm,
-                     const map<string, pair<int, flt_type> > &class_memberships,
-                     string unk_symbol,
-                     vector<string> &words,
-                     long int &num_words,
-                     long int &num_oovs)
-{
-    stringstream ss(line);
-    words.clear();
-    string word;
-    while (ss >> word) {
-        if (word == "<s>") continue;
-        if (word == "</s>") continue;
-        if (lm.vocabulary_lookup.find(word) == lm.vocabulary_lookup.end()
-            || class_memberships.find(word) == class_memberships.end()
-            || word == "<unk>"  || word == "<UNK>")
-        {
-            words.push_back(unk_symbol);
-            num_oovs++;
-        }
-        else {
-            words.push_back(word);
-            num_words++;
-        }
+// A word n-gram model and a class n-gram model, the entries
+// map the scored words to their indices in both models
+class ModelPair {
+public:
+    LNNgram ngram;
+    LNNgram class_ngram;
+    std::vector<ScoringVocabulary::Entry> entries;
+};
+
+
+// Perplexity statistics for a set of interpolation weights
+class InterpolationStats : public PplStats {
+public:
+    void add(const InterpolationStats &other) {
+        PplStats::add(other);
+        if (total_lls.size() < other.total_lls.size())
+            total_lls.resize(other.total_lls.size(), 0.0);
+        for (unsigned int i=0; i<other.total_lls.size(); i++)
+            total_lls[i] += other.total_lls[i];
+        if (token_scores.size() < other.token_scores.size())
+            token_scores.resize(other.token_scores.size());
+        for (unsigned int c=0; c<other.token_scores.size(); c++)
+            token_scores[c].insert(token_scores[c].end(),
+                                   other.token_scores[c].begin(), other.token_scores[c].end());
     }
-    num_words++;
+    std::vector<double> total_lls;
+    // Per-token log probabilities of each component model,
+    // stored if optimizing the weights
+    std::vector<std::vector<float> > token_scores;
+};
+
+
+// Interpolates the log probabilities of the components
+double
+interpolate(const vector<vector<double> > &component_scores,
+            const vector<double> &log_weights,
+            int token)
+{
+    double lp = component_scores[0][token] + log_weights[0];
+    for (unsigned int c=1; c<component_scores.size(); c++)
+        lp = add_log_domain_probs(lp, component_scores[c][token] + log_weights[c]);
+    return lp;
 }
 
 
+// Scores each token once with all the models and accumulates the
+// interpolated likelihood for all weights. The components are the
+// word and the class model of each pair in turn.
 void
-evaluate(const LNNgram &ngram,
-         const LNNgram &class_ngram,
-         vector<int> &indexmap,
-         const map<string, pair<int, flt_type> > &class_memberships,
-         conf::Config &config,
-         string infname,
-         double iw=0.5)
+score_sentences(const vector<ModelPair> &models,
+                vector<vector<NgramCache> > &caches,
+                int thread_idx,
+                const ScoringVocabulary &vocab,
+                bool root_unk_states,
+                const vector<vector<double> > &weights,
+                bool cache_token_scores,
+                const vector<string> &lines,
+                InterpolationStats &stats)
 {
-    double word_iw = log(iw);
-    double class_iw = log(1.0-iw);
-
-    cerr << endl << "Evaluating sentences.." << endl;
-    SimpleFileInput infile(infname);
-    string line;
-    long int num_words = 0;
-    long int num_sents = 0;
-    long int num_oovs = 0;
-    double total_ll = 0.0;
-    while (infile.getline(line)) {
-
-        line = str::cleaned(line);
-        if (line.length() == 0) continue;
-
-        double sent_ll = 0.0;
-
-        vector<string> words;
-        string unk = "<unk>";
-        preprocess_sent(line, ngram, class_memberships, unk, words, num_words, num_oovs);
-
-        int curr_lm_node = ngram.sentence_start_node;
-        int curr_class_lm_node = class_ngram.sentence_start_node;
+    int num_components = 2*models.size();
+    int num_weights = weights.size();
+    vector<vector<double> > log_weights(num_weights, vector<double>(num_components));
+    for (int w=0; w<num_weights; w++)
+        for (int c=0; c<num_components; c++)
+            log_weights[w][c] = log(weights[w][c]);
+    stats.total_lls.assign(num_weights, 0.0);
+    if (cache_token_scores) stats.token_scores.resize(num_components);
+
+    vector<int> word_indices;
+    vector<int> nodes(num_components);
+    vector<vector<double> > component_scores(num_components);
+
+    for (auto lit = lines.begin(); lit != lines.end(); ++lit) {
+
+        if (vocab.map_sentence(*lit, word_indices) == 0) continue;
+
+        for (int c=0; c<num_components; c++) {
+            const LNNgram &lm = (c % 2 == 0) ? models[c/2].ngram : models[c/2].class_ngram;
+            nodes[c] = lm.sentence_start_node;
+            component_scores[c].clear();
+        }
 
-        for (int i=0; i<(int)words.size(); i++) {
-            if (words[i] == unk) {
-                if (config["unk-root-node"].specified) {
-                    curr_lm_node = ngram.root_node;
-                    curr_class_lm_node = class_ngram.root_node;
+        for (auto wit=word_indices.begin(); wit != word_indices.end(); ++wit) {
+            if (*wit == -1) stats.num_oovs++;
+            else stats.num_words++;
+            for (int c=0; c<num_components; c++) {
+                const ModelPair &pair = models[c/2];
+                NgramCache &cache = caches[c][thread_idx];
+                if (c % 2 == 0) {
+                    if (*wit == -1) {
+                        nodes[c] = root_unk_states ? pair.ngram.root_node
+                            : cache.advance(nodes[c], pair.ngram.unk_symbol_idx);
+                        continue;
+                    }
+                    double ngram_score = 0.0;
+                    nodes[c] = cache.score(nodes[c], pair.entries[*wit].word_lm_idx, ngram_score);
+                    component_scores[c].push_back(ngram_score);
                 }
                 else {
-                    curr_lm_node = ngram.advance(curr_lm_node, ngram.unk_symbol_idx);
-                    curr_class_lm_node = class_ngram.advance(curr_class_lm_node, class_ngram.unk_symbol_idx);
+                    if (*wit == -1) {
+                        nodes[c] = root_unk_states ? pair.class_ngram.root_node
+                            : cache.advance(nodes[c], pair.class_ngram.unk_symbol_idx);
+                        continue;
+                    }
+                    const ScoringVocabulary::Entry &entry = pair.entries[*wit];
+                    double class_score = 0.0;
+                    nodes[c] = cache.score(nodes[c], entry.class_lm_idx, class_score);
+                    component_scores[c].push_back(class_score + entry.class_lp);
                 }
-            } else {
-                double ngram_score = 0.0;
-                curr_lm_node = ngram.score(curr_lm_node, ngram.vocabulary_lookup.at(words[i]), ngram_score);
-                ngram_score += word_iw;
-
-                pair<int, flt_type> word_class = class_memberships.at(words[i]);
-                double class_score = 0.0;
-                curr_class_lm_node = class_ngram.score(curr_class_lm_node, indexmap[word_class.first], class_score);
-                class_score += word_class.second;
-                class_score += class_iw;
-
-                sent_ll += add_log_domain_probs(ngram_score, class_score);
             }
         }
 
-        double ngram_score = 0.0;
-        curr_lm_node = ngram.score(curr_lm_node, ngram.sentence_end_symbol_idx, ngram_score);
-        ngram_score += word_iw;
+        for (int c=0; c<num_components; c++) {
+            const LNNgram &lm = (c % 2 == 0) ? models[c/2].ngram : models[c/2].class_ngram;
+            double score = 0.0;
+            nodes[c] = caches[c][thread_idx].score(nodes[c], lm.sentence_end_symbol_idx, score);
+            component_scores[c].push_back(score);
+        }
+        stats.num_words++;
+
+        int num_tokens = component_scores[0].size();
+        if (cache_token_scores)
+            for (int c=0; c<num_components; c++)
+                stats.token_scores[c].insert(stats.token_scores[c].end(),
+                                             component_scores[c].begin(), component_scores[c].end());
+        for (int w=0; w<num_weights; w++) {
+            double sent_ll = 0.0;
+            for (int i=0; i<num_tokens; i++)
+                sent_ll += interpolate(component_scores, log_weights[w], i);
+            stats.total_lls[w] += sent_ll;
+        }
+        stats.num_sents++;
+    }
+}
 
-        double class_score = 0.0;
-        curr_class_lm_node = class_ngram.score(curr_class_lm_node, class_ngram.sentence_end_symbol_idx, class_score);
-        class_score += class_iw;
 
-        sent_ll += add_log_domain_probs(ngram_score, class_score);
-        total_ll += sent_ll;
-        num_sents++;
-    }
+// The word model weight for a single pair of models,
+// otherwise the weights of all the components
+string
+weights_str(const vector<double> &weights)
+{
+    if (weights.size() == 2) return str::fmt(64, "%g", weights[0]);
+    string result;
+    for (unsigned int c=0; c<weights.size(); c++)
+        result += (c > 0 ? ", " : "") + str::fmt(64, "%g", weights[c]);
+    return result;
+}
 
-    cerr << "Interpolation weight: " << iw << endl;
-    cerr << "Number of sentences: " << num_sents << endl;
-    cerr << "Number of in-vocabulary words excluding sentence ends: " << num_words-num_sents << endl;
-    cerr << "Number of in-vocabulary words including sentence ends: " << num_words << endl;
-    cerr << "Number of OOV words: " << num_oovs << endl;
+
+void
+print_results(conf::Config &config,
+              const PplStats &stats,
+              const vector<double> &weights,
+              double total_ll)
+{
+    cerr << endl;
+    cerr << (weights.size() == 2 ? "Interpolation weight: " : "Interpolation weights: ")
+         << weights_str(weights) << endl;
+    cerr << "Number of sentences: " << stats.num_sents << endl;
+    cerr << "Number of in-vocabulary words excluding sentence ends: " << stats.num_words-stats.num_sents << endl;
+    cerr << "Number of in-vocabulary words including sentence ends: " << stats.num_words << endl;
+    cerr << "Number of OOV words: " << stats.num_oovs << endl;
     cerr << "Total log likelihood (ln): " << total_ll << endl;
     cerr << "Total log likelihood (log10): " << total_ll/2.302585092994046 << endl;
 
-    double ppl = exp(-1.0/double(num_words) * total_ll);
+    double ppl = exp(-1.0/double(stats.num_words) * total_ll);
     cerr << "Perplexity: " << ppl << endl;
 
     if (config["num-words"].specified) {
@@ -131,22 +191,144 @@ evaluate(const LNNgram &ngram,
 }
 
 
+void
+evaluate(const vector<ModelPair> &models,
+         const ScoringVocabulary &vocab,
+         conf::Config &config,
+         string infname,
+         const vector<vector<double> > &weights)
+{
+    bool root_unk_states = config["unk-root-node"].specified;
+    int num_threads = config["num-threads"].get_int();
+    bool optimize_weights = config["optimize-weights"].specified;
+    int num_components = 2*models.size();
+
+    int cache_bits = config["cache-bits"].get_int();
+    vector<vector<NgramCache> > caches;
+    for (int c=0; c<num_components; c++) {
+        const LNNgram &lm = (c % 2 == 0) ? models[c/2].ngram : models[c/2].class_ngram;
+        caches.push_back(vector<NgramCache>(max(num_threads, 1), NgramCache(lm, cache_bits)));
+    }
+
+    cerr << endl << "Evaluating sentences.." << endl;
+    SimpleFileInput infile(infname);
+    InterpolationStats stats;
+    process_lines<InterpolationStats>(infile, num_threads,
+        [&](const vector<string> &lines, InterpolationStats &batch_stats, int thread_idx) {
+            score_sentences(models, caches, thread_idx, vocab,
+                            root_unk_states, weights, optimize_weights, lines, batch_stats);
+        },
+        stats);
+    stats.total_lls.resize(weights.size(), 0.0);
+    stats.token_scores.resize(num_components);
+
+    if (cache_bits > 0) {
+        for (int c=0; c<num_components; c++) {
+            cerr << (c % 2 == 0 ? "Word" : "Class") << " n-gram ";
+            if (models.size() > 1) cerr << c/2+1 << " ";
+            cerr << "cache hit rate: " << cache_hit_rate(caches[c]) << endl;
+        }
+    }
+
+    for (int w=0; w<(int)weights.size(); w++)
+        print_results(config, stats, weights[w], stats.total_lls[w]);
+
+    if (optimize_weights) {
+        cerr << endl << "Optimizing the interpolation weights with EM.." << endl;
+        vector<vector<float> > component_lps;
+        component_lps.swap(stats.token_scores);
+        // EM can not move a weight away from zero
+        vector<double> em_weights = weights[0];
+        for (int c=0; c<num_components; c++)
+            if (!(em_weights[c] > 0.0)) em_weights.assign(num_components, 1.0/num_components);
+        optimize_interpolation_weights(component_lps, em_weights);
+
+        // Likelihood with the final weights
+        vector<double> log_weights(num_components);
+        for (int c=0; c<num_components; c++)
+            log_weights[c] = log(em_weights[c]);
+        double total_ll = 0.0;
+        for (long int t=0; t<(long int)component_lps[0].size(); t++) {
+            double lp = component_lps[0][t] + log_weights[0];
+            for (int c=1; c<num_components; c++)
+                lp = add_log_domain_probs(lp, component_lps[c][t] + log_weights[c]);
+            total_ll += lp;
+        }
+        cerr << (num_components == 2 ? "Optimized interpolation weight: " : "Optimized interpolation weights: ")
+             << weights_str(em_weights) << endl;
+        print_results(config, stats, em_weights, total_ll);
+    }
+}
+
+
+// Reads a word model, a class model and class memberships, and maps
+// the words in both models to their indices. Words of classes missing
+// from the class model are left out.
+void
+read_models(conf::Config &config,
+            string arpafname,
+            string classngramfname,
+            string classmfname,
+            ModelPair &models,
+            vector<string> &words,
+            unordered_map<string, ScoringVocabulary::Entry> &entries)
+{
+    models.ngram.read(arpafname);
+    if (config["quantize"].specified) models.ngram.quantize(config["quantize"].get_int());
+    if (config["hash-lookup"].specified) models.ngram.use_hash_lookup();
+
+    ClassMemberships class_memberships;
+    cerr << "Reading class memberships.." << endl;
+    class_memberships.read(classmfname);
+    int num_classes = class_memberships.num_classes;
+
+    cerr << "Reading class n-gram model.." << endl;
+    models.class_ngram.read(classngramfname);
+    if (config["quantize"].specified) models.class_ngram.quantize(config["quantize"].get_int());
+    if (config["hash-lookup"].specified) models.class_ngram.use_hash_lookup();
+
+    // The class indexes are stored as strings in the n-gram class,
+    // words of classes missing from the model are OOVs
+    vector<int> indexmap(num_classes, -1);
+    for (int i=0; i<(int)indexmap.size(); i++)
+        if (models.class_ngram.vocabulary_lookup.find(int2str(i)) != models.class_ngram.vocabulary_lookup.end())
+            indexmap[i] = models.class_ngram.vocabulary_lookup[int2str(i)];
+
+    for (int i=0; i<class_memberships.size(); i++) {
+        string word = class_memberships.word(i);
+        if (word == "<unk>" || word == "<UNK>") continue;
+        int class_idx = indexmap[class_memberships.word_class(i)];
+        if (class_idx == -1) continue;
+        auto vlit = models.ngram.vocabulary_lookup.find(word);
+        if (vlit == models.ngram.vocabulary_lookup.end()) continue;
+        words.push_back(word);
+        entries[word] = ScoringVocabulary::Entry(vlit->second, class_idx, class_memberships.log_prob(i));
+    }
+}
+
+
 int main(int argc, char* argv[])
 {
     try {
         conf::Config config;
-        config("usage: classintppl [OPTION...] ARPAFILE CLASS_ARPA CLASS_MEMBERSHIPS INPUT\n")
+        config("usage: classintppl [OPTION...] ARPAFILE CLASS_ARPA CLASS_MEMBERSHIPS [ARPAFILE CLASS_ARPA CLASS_MEMBERSHIPS ...] INPUT\n"
+               "With more than one model triple, the weights are given for all the\n"
+               "models in the order of the arguments, by default the weights are equal.\n")
         ('i', "weights=FLOAT", "arg", "0.5", "Comma separated list of interpolation weights [0.0,1.0] for the word ARPA model")
         ('r', "unk-root-node", "", "", "Pass through root node in contexts with unks, DEFAULT: advance with unk symbol")
         ('w', "num-words=INT", "arg", "", "Number of words for computing word-normalized perplexity")
+        ('q', "quantize=INT", "arg", "", "Quantize probabilities to INT bits (1-16) in a compact model representation")
+        ('l', "hash-lookup", "", "", "Use hash tables instead of binary search for n-gram lookups")
+        ('t', "num-threads=INT", "arg", "1", "Number of scoring threads, default: 1")
+        ('c', "cache-bits=INT", "arg", "0", "Cache n-gram scores in 2^INT entries per thread, default: 0 (no cache)")
+        ('e', "optimize-weights", "", "", "Optimize the interpolation weights with EM, the first weights are used as the initialization")
         ('h', "help", "", "", "display help");
         config.default_parse(argc, argv);
-        if (config.arguments.size() != 4) config.print_help(stderr, 1);
+        if (config.arguments.size() < 4 || (config.arguments.size()-1) % 3 != 0) config.print_help(stderr, 1);
 
-        string arpafname = config.arguments[0];
-        string classngramfname = config.arguments[1];
-        string classmfname = config.arguments[2];
-        string infname = config.arguments[3];
+        int num_pairs = (config.arguments.size()-1) / 3;
+        int num_components = 2*num_pairs;
+        string infname = config.arguments.back();
 
         vector<string> str_weights = str::split(config["weights"].get_str(), ",", false);
         vector<double> weights;
@@ -168,30 +350,56 @@ int main(int argc, char* argv[])
             }
         }
 
-        LNNgram ngram;
-        ngram.read_arpa(arpafname);
-
-        map<string, pair<int, flt_type> > class_memberships;
-        cerr << "Reading class memberships.." << endl;
-        int num_classes = read_class_memberships(classmfname, class_memberships);
-
-        cerr << "Reading class n-gram model.." << endl;
-        LNNgram class_ngram;
-        class_ngram.read_arpa(classngramfname);
-
-        // The class indexes are stored as strings in the n-gram class
-        vector<int> indexmap(num_classes);
-        for (int i=0; i<(int)indexmap.size(); i++)
-            if (class_ngram.vocabulary_lookup.find(int2str(i)) != class_ngram.vocabulary_lookup.end())
-                indexmap[i] = class_ngram.vocabulary_lookup[int2str(i)];
-            else indexmap[i] = -1;
-
-        cerr << "evaluating " << weights.size() << " interpolation weights: ";
-        for (int i=0; i<(int)weights.size(); i++)
-            cerr << (i>0 ? ", " : "") << weights[i];
-        cerr << endl;
-        for (int i=0; i<(int)weights.size(); i++)
-            evaluate(ngram, class_ngram, indexmap, class_memberships, config, infname, weights[i]);
+        // Each weight is evaluated separately for a single pair of models,
+        // more models are evaluated with one weight per model
+        vector<vector<double> > weight_sets;
+        if (num_pairs == 1) {
+            for (auto wit = weights.begin(); wit != weights.end(); ++wit)
+                weight_sets.push_back({ *wit, 1.0-*wit });
+        }
+        else if (!config["weights"].specified) {
+            weight_sets.push_back(vector<double>(num_components, 1.0/num_components));
+        }
+        else {
+            double weight_sum = 0.0;
+            for (auto wit = weights.begin(); wit != weights.end(); ++wit)
+                weight_sum += *wit;
+            if ((int)weights.size() != num_components || fabs(weight_sum-1.0) > 1e-4)
+                throw string("Give " + int2str(num_components) + " interpolation weights summing to one, one per model");
+            weight_sets.push_back(weights);
+        }
+
+        vector<ModelPair> models(num_pairs);
+        vector<string> words;
+        vector<unordered_map<string, ScoringVocabulary::Entry> > entries(num_pairs);
+        for (int p=0; p<num_pairs; p++) {
+            vector<string> pair_words;
+            read_models(config, config.arguments[3*p], config.arguments[3*p+1], config.arguments[3*p+2],
+                        models[p], pair_words, entries[p]);
+            if (p == 0) words.swap(pair_words);
+        }
+
+        // Words missing from any of the models are OOVs
+        ScoringVocabulary vocab;
+        for (auto wit = words.begin(); wit != words.end(); ++wit) {
+            bool in_all_models = true;
+            for (int p=1; p<num_pairs; p++)
+                if (entries[p].find(*wit) == entries[p].end()) in_all_models = false;
+            if (!in_all_models) continue;
+            vocab.add(*wit, entries[0][*wit]);
+            for (int p=0; p<num_pairs; p++)
+                models[p].entries.push_back(entries[p][*wit]);
+        }
+        entries.clear();
+
+        if (num_pairs == 1) {
+            cerr << "evaluating " << weights.size() << " interpolation weights: ";
+            for (int i=0; i<(int)weights.size(); i++)
+                cerr << (i>0 ? ", " : "") << weights[i];
+            cerr << endl;
+        }
+        else cerr << "evaluating interpolation weights: " << weights_str(weight_sets[0]) << endl;
+        evaluate(models, vocab, config, infname, weight_sets);
 
         exit(EXIT_SUCCESS);
 
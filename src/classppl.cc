@@ -1,16 +1,69 @@
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <sstream>
 
 #include "str.hh"
 #include "defs.hh"
+#include "ClassMemberships.hh"
 #include "io.hh"
 #include "conf.hh"
+#include "parallel.hh"
 #include "Ngram.hh"
 
 using namespace std;
 
 
+void
+score_sentences(const LNNgram &ng,
+                NgramCache &cache,
+                const ScoringVocabulary &vocab,
+                bool root_unk_states,
+                bool write_scores,
+                bool write_token_scores,
+                const vector<string> &lines,
+                ScoredBatch &batch)
+{
+    vector<int> word_indices;
+    vector<double> token_scores;
+    for (auto lit = lines.begin(); lit != lines.end(); ++lit) {
+
+        SentenceScore sent_score;
+        token_scores.clear();
+        if (vocab.map_sentence(*lit, word_indices) == 0) {
+            batch.add_sentence(sent_score, write_scores, write_token_scores ? &token_scores : nullptr);
+            continue;
+        }
+
+        int curr_node = ng.sentence_start_node;
+        for (auto wit=word_indices.begin(); wit != word_indices.end(); ++wit) {
+            if (*wit == -1) {
+                if (root_unk_states) curr_node = ng.root_node;
+                else curr_node = cache.advance(curr_node, ng.unk_symbol_idx);
+                sent_score.num_oovs++;
+                if (write_token_scores) token_scores.push_back(NAN);
+                continue;
+            }
+
+            const ScoringVocabulary::Entry &entry = vocab.entries[*wit];
+            double ngram_score = 0.0;
+            curr_node = cache.score(curr_node, entry.class_lm_idx, ngram_score);
+            sent_score.ll += entry.class_lp + ngram_score;
+            sent_score.num_words++;
+            if (write_token_scores) token_scores.push_back(entry.class_lp + ngram_score);
+        }
+
+        double ngram_score = 0.0;
+        curr_node = cache.score(curr_node, ng.sentence_end_symbol_idx, ngram_score);
+        sent_score.ll += ngram_score;
+        sent_score.num_words++;
+        if (write_token_scores) token_scores.push_back(ngram_score);
+
+        batch.add_sentence(sent_score, write_scores, write_token_scores ? &token_scores : nullptr);
+    }
+}
+
+
 int main(int argc, char* argv[])
 {
     try {
@@ -18,6 +71,12 @@ int main(int argc, char* argv[])
         config("usage: classppl [OPTION...] CLASS_ARPA CLASS_MEMBERSHIPS INPUT\n")
         ('r', "use-root-node", "", "", "Pass through root node in contexts with unks, DEFAULT: advance with unk symbol")
         ('w', "num-words=INT", "arg", "", "Number of words for computing word-normalized perplexity")
+        ('q', "quantize=INT", "arg", "", "Quantize probabilities to INT bits (1-16) in a compact model representation")
+        ('l', "hash-lookup", "", "", "Use hash tables instead of binary search for n-gram lookups")
+        ('t', "num-threads=INT", "arg", "1", "Number of scoring threads, default: 1")
+        ('c', "cache-bits=INT", "arg", "0", "Cache n-gram scores in 2^INT entries per thread, default: 0 (no cache)")
+        ('o', "score-output=FILE", "arg", "", "Write the log likelihood (ln), number of words and OOVs of each line to FILE")
+        ('k', "token-scores", "", "", "Write also the log probability of each token to the score output")
         ('h', "help", "", "", "display help");
         config.default_parse(argc, argv);
         if (config.arguments.size() != 3) config.print_help(stderr, 1);
@@ -26,94 +85,70 @@ int main(int argc, char* argv[])
         string classmfname = config.arguments[1];
         string infname = config.arguments[2];
 
-        string unk = "<unk>";
         bool root_unk_states = config["use-root-node"].specified;
+        int num_threads = config["num-threads"].get_int();
 
-        map<string, pair<int, flt_type> > class_memberships;
+        ClassMemberships class_memberships;
         cerr << "Reading class memberships.." << endl;
-        int num_classes = read_class_memberships(classmfname, class_memberships);
+        class_memberships.read(classmfname);
+        int num_classes = class_memberships.num_classes;
 
         cerr << "Reading class n-gram model.." << endl;
         LNNgram ng;
-        ng.read_arpa(ngramfname);
+        ng.read(ngramfname);
+        if (config["quantize"].specified) ng.quantize(config["quantize"].get_int());
+        if (config["hash-lookup"].specified) ng.use_hash_lookup();
 
-        // The class indexes are stored as strings in the n-gram class
-        vector<int> indexmap(num_classes);
+        // The class indexes are stored as strings in the n-gram class,
+        // words of classes missing from the model are OOVs
+        vector<int> indexmap(num_classes, -1);
         for (int i=0; i<(int)indexmap.size(); i++)
             if (ng.vocabulary_lookup.find(int2str(i)) != ng.vocabulary_lookup.end())
                 indexmap[i] = ng.vocabulary_lookup[int2str(i)];
 
+        ScoringVocabulary vocab;
+        for (int i=0; i<class_memberships.size(); i++) {
+            string word = class_memberships.word(i);
+            if (word == "<unk>" || word == "<UNK>") continue;
+            int class_idx = indexmap[class_memberships.word_class(i)];
+            if (class_idx == -1) continue;
+            vocab.add(word, ScoringVocabulary::Entry(-1, class_idx, class_memberships.log_prob(i)));
+        }
+        class_memberships.clear();
+
         cerr << "Scoring sentences.." << endl;
-        SimpleFileInput infile(infname);
-        string line;
-        long int num_words = 0;
-        long int num_sents = 0;
-        long int num_oovs = 0;
-        double total_ll = 0.0;
-        int linei = 0;
-        while (infile.getline(line)) {
-
-            line = str::cleaned(line);
-            if (line.length() == 0) continue;
-            if (++linei % 10000 == 0) cerr << "sentence " << linei << endl;
-
-            stringstream ss(line);
-            vector<string> words;
-            string word;
-            while (ss >> word) {
-                if (word == "<s>") continue;
-                if (word == "</s>") continue;
-                if (class_memberships.find(word) == class_memberships.end()
-                    || word == "<unk>"  || word == "<UNK>")
-                {
-                    words.push_back(unk);
-                    num_oovs++;
-                }
-                else {
-                    words.push_back(word);
-                    num_words++;
-                }
-            }
-            num_words++;
-
-            double sent_ll = 0.0;
-
-            int curr_node = ng.sentence_start_node;
-            for (int i=0; i<(int)words.size(); i++) {
-                if (words[i] == unk) {
-                    if (root_unk_states) curr_node = ng.root_node;
-                    else curr_node = ng.advance(curr_node, ng.unk_symbol_idx);
-                    continue;
-                }
-
-                pair<int, flt_type> word_class = class_memberships.at(words[i]);
-                sent_ll += word_class.second;
-                double ngram_score = 0.0;
-                curr_node = ng.score(curr_node, indexmap[word_class.first], ngram_score);
-                sent_ll += ngram_score;
-            }
+        vector<NgramCache> caches(max(num_threads, 1), NgramCache(ng, config["cache-bits"].get_int()));
 
-            double ngram_score = 0.0;
-            curr_node = ng.score(curr_node, ng.sentence_end_symbol_idx, ngram_score);
-            sent_ll += ngram_score;
+        bool write_scores = config["score-output"].specified;
+        bool write_token_scores = write_scores && config["token-scores"].specified;
+        unique_ptr<SimpleFileOutput> scorefile;
+        if (write_scores) scorefile.reset(new SimpleFileOutput(config["score-output"].get_str()));
 
-            total_ll += sent_ll;
-            num_sents++;
-        }
+        SimpleFileInput infile(infname);
+        ScoredBatch stats(scorefile.get());
+        process_lines<ScoredBatch>(infile, num_threads,
+            [&](const vector<string> &lines, ScoredBatch &batch, int thread_idx) {
+                score_sentences(ng, caches[thread_idx], vocab, root_unk_states,
+                                write_scores, write_token_scores, lines, batch);
+            },
+            stats, 1000, 10000);
+        if (scorefile) scorefile->close();
 
         cerr << endl;
-        cerr << "Number of sentences: " << num_sents << endl;
-        cerr << "Number of in-vocabulary words excluding sentence ends: " << num_words-num_sents << endl;
-        cerr << "Number of in-vocabulary words including sentence ends: " << num_words << endl;
-        cerr << "Number of OOV words: " << num_oovs << endl;
-        cerr << "Total log likelihood: " << total_ll << endl;
-        cerr << "Total log likelihood (log10): " << total_ll/log(10.0) << endl;
-
-        double ppl = exp(-1.0/double(num_words) * total_ll);
+        cerr << "Number of sentences: " << stats.num_sents << endl;
+        cerr << "Number of in-vocabulary words excluding sentence ends: " << stats.num_words-stats.num_sents << endl;
+        cerr << "Number of in-vocabulary words including sentence ends: " << stats.num_words << endl;
+        cerr << "Number of OOV words: " << stats.num_oovs << endl;
+        cerr << "Total log likelihood: " << stats.total_ll << endl;
+        cerr << "Total log likelihood (log10): " << stats.total_ll/log(10.0) << endl;
+
+        double ppl = exp(-1.0/double(stats.num_words) * stats.total_ll);
         cerr << "Perplexity: " << ppl << endl;
+        if (config["cache-bits"].get_int() > 0)
+            cerr << "N-gram cache hit rate: " << cache_hit_rate(caches) << endl;
 
         if (config["num-words"].specified) {
-            double wnppl = exp(-1.0/double(config["num-words"].get_int()) * total_ll);
+            double wnppl = exp(-1.0/double(config["num-words"].get_int()) * stats.total_ll);
             cerr << "Word-normalized perplexity: " << wnppl << endl;
         }
 
@@ -0,0 +1,31 @@
+#include <iostream>
+#include <string>
+
+#include "conf.hh"
+#include "ClassMemberships.hh"
+
+using namespace std;
+
+
+int main(int argc, char* argv[])
+{
+    try {
+        conf::Config config;
+        config("usage: cmem2bin [OPTION...] CLASS_MEMBERSHIPS BINFILE\n"
+               "Converts class memberships to the binary format which is\n"
+               "memory mapped by the class tools and exchange -i.\n")
+        ('h', "help", "", "", "display help");
+        config.default_parse(argc, argv);
+        if (config.arguments.size() != 2) config.print_help(stderr, 1);
+
+        ClassMemberships class_memberships;
+        class_memberships.read(config.arguments[0]);
+        class_memberships.write_binary(config.arguments[1]);
+
+        exit(EXIT_SUCCESS);
+
+    } catch (string &e) {
+        cerr << e << endl;
+        exit(EXIT_FAILURE);
+    }
+}
@@ -6,8 +6,13 @@
 #include <cstdio>
 #include <map>
 #include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "io.hh"
+#include "str.hh"
+#include "Ngram.hh"
 
 typedef float flt_type;
 
@@ -32,6 +37,59 @@ static flt_type sub_log_domain_probs(flt_type a, flt_type b) {
     return a + log1p(-exp(delta));
 }
 
+// Optimizes the interpolation weights of component models with EM.
+// component_lps holds the per-token log probabilities of each component,
+// the weights are used as the initialization and are kept if there are no
+// tokens. Returns the log likelihood of the last iteration.
+static double
+optimize_interpolation_weights(const std::vector<std::vector<float> > &component_lps,
+                               std::vector<double> &weights,
+                               int max_iter=100,
+                               double tolerance=1e-7)
+{
+    int num_components = component_lps.size();
+    long int num_tokens = num_components > 0 ? component_lps[0].size() : 0;
+    if ((int)weights.size() != num_components)
+        weights.assign(num_components, 1.0/num_components);
+    if (num_tokens == 0) return 0.0;
+
+    std::vector<double> log_weights(num_components), posteriors(num_components);
+    std::vector<double> lps(num_components);
+    double prev_ll = -1e100;
+    double ll = 0.0;
+    for (int iter=0; iter<max_iter; iter++) {
+        for (int c=0; c<num_components; c++) {
+            log_weights[c] = log(weights[c]);
+            posteriors[c] = 0.0;
+        }
+
+        ll = 0.0;
+        for (long int t=0; t<num_tokens; t++) {
+            double max_lp = -1e100;
+            for (int c=0; c<num_components; c++) {
+                lps[c] = log_weights[c] + component_lps[c][t];
+                if (lps[c] > max_lp) max_lp = lps[c];
+            }
+            double sum = 0.0;
+            for (int c=0; c<num_components; c++) {
+                lps[c] = exp(lps[c]-max_lp);
+                sum += lps[c];
+            }
+            for (int c=0; c<num_components; c++)
+                posteriors[c] += lps[c]/sum;
+            ll += max_lp + log(sum);
+        }
+
+        for (int c=0; c<num_components; c++)
+            weights[c] = posteriors[c]/num_tokens;
+
+        if (ll-prev_ll < tolerance*fabs(ll)) break;
+        prev_ll = ll;
+    }
+
+    return ll;
+}
+
 static int str2int(std::string str) {
     int val;
     std::istringstream numstr(str);
@@ -46,24 +104,242 @@ static std::string int2str(int a)
     return temp.str();
 }
 
-static int
-read_class_memberships(std::string fname,
-                       std::map<std::string, std::pair<int, flt_type> > &class_memberships)
+// Counts and log likelihood accumulated in perplexity evaluations
+class PplStats {
+public:
+    PplStats() : num_words(0), num_sents(0), num_oovs(0), total_ll(0.0) { }
+    void add(const PplStats &other) {
+        num_words += other.num_words;
+        num_sents += other.num_sents;
+        num_oovs += other.num_oovs;
+        total_ll += other.total_ll;
+    }
+    long int num_words;
+    long int num_sents;
+    long int num_oovs;
+    double total_ll;
+};
+
+// Combined hit rate of per-thread n-gram caches
+static double
+cache_hit_rate(const std::vector<NgramCache> &caches)
+{
+    long int hits = 0, misses = 0;
+    for (auto cit = caches.begin(); cit != caches.end(); ++cit) {
+        hits += cit->hits;
+        misses += cit->misses;
+    }
+    return (hits+misses) > 0 ? double(hits)/double(hits+misses) : 0.0;
+}
+
+// Maps each word once to its indices in the language models
+// so that scoring works on integer arrays
+class ScoringVocabulary {
+public:
+    class Entry {
+    public:
+        Entry(int word_lm_idx=-1, int class_lm_idx=-1, flt_type class_lp=0.0)
+            : word_lm_idx(word_lm_idx), class_lm_idx(class_lm_idx), class_lp(class_lp) { }
+        int word_lm_idx;
+        int class_lm_idx;
+        flt_type class_lp;
+    };
+
+    void add(const std::string &word, const Entry &entry) {
+        lookup[word] = entries.size();
+        entries.push_back(entry);
+    }
+
+    // Maps the tokens of a line to entry indices, -1 for unknown words.
+    // Sentence boundary tokens are skipped. Returns the number of tokens.
+    int map_sentence(const std::string &line,
+                     std::vector<int> &word_indices) const
+    {
+        word_indices.clear();
+        std::string token;
+        int num_tokens = 0;
+        const char *ptr = line.c_str();
+        while (true) {
+            while (*ptr == ' ' || *ptr == '\t' || *ptr == '\n' || *ptr == '\r') ptr++;
+            if (*ptr == '\0') break;
+            const char *token_start = ptr;
+            while (*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && *ptr != '\n' && *ptr != '\r') ptr++;
+            token.assign(token_start, ptr-token_start);
+            num_tokens++;
+            if (token == "<s>" || token == "</s>") continue;
+            auto it = lookup.find(token);
+            word_indices.push_back(it != lookup.end() ? it->second : -1);
+        }
+        return num_tokens;
+    }
+
+    std::vector<Entry> entries;
+    std::unordered_map<std::string, int> lookup;
+};
+
+// Log likelihood and word counts of one sentence,
+// num_words is zero for empty lines
+class SentenceScore {
+public:
+    SentenceScore() : ll(0.0), num_words(0), num_oovs(0) { }
+    double ll;
+    int num_words;
+    int num_oovs;
+};
+
+// Scores a batch of sentences position by position so that the
+// n-gram lookups of different sentences are interleaved.
+// With a class model, words are mapped to classes and the
+// class membership probabilities are added. If token_scores is
+// given, the score of each token is stored there, NAN for OOVs.
+static void
+score_sentence_batch(const Ngram &lm,
+                     const ScoringVocabulary &vocab,
+                     bool class_lm,
+                     bool root_unk_states,
+                     const std::vector<std::string> &lines,
+                     std::vector<SentenceScore> &scores,
+                     std::vector<std::vector<double> > *token_scores=nullptr)
+{
+    std::vector<std::vector<int> > sentences(lines.size());
+    scores.assign(lines.size(), SentenceScore());
+    if (token_scores != nullptr) {
+        token_scores->resize(lines.size());
+        for (auto tit = token_scores->begin(); tit != token_scores->end(); ++tit)
+            tit->clear();
+    }
+    size_t max_length = 0;
+    for (size_t s=0; s<lines.size(); s++) {
+        if (vocab.map_sentence(lines[s], sentences[s]) == 0) continue;
+        sentences[s].push_back(-2);
+        max_length = std::max(max_length, sentences[s].size());
+    }
+
+    std::vector<int> sent_nodes(sentences.size(), lm.sentence_start_node);
+    std::vector<int> lane_sents, lane_nodes, lane_words;
+    std::vector<double> lane_scores;
+    for (size_t pos=0; pos<max_length; pos++) {
+        lane_sents.clear();
+        lane_nodes.clear();
+        lane_words.clear();
+        for (int s=0; s<(int)sentences.size(); s++) {
+            if (pos >= sentences[s].size()) continue;
+            int word_idx = sentences[s][pos];
+            int word;
+            if (word_idx == -2) word = lm.sentence_end_symbol_idx;
+            else if (word_idx != -1) {
+                const ScoringVocabulary::Entry &entry = vocab.entries[word_idx];
+                word = class_lm ? entry.class_lm_idx : entry.word_lm_idx;
+            }
+            else {
+                scores[s].num_oovs++;
+                if (token_scores != nullptr) (*token_scores)[s].push_back(NAN);
+                if (root_unk_states) { sent_nodes[s] = lm.root_node; continue; } // SRILM
+                word = lm.unk_symbol_idx; // VariKN style UNKs
+            }
+            lane_sents.push_back(s);
+            lane_nodes.push_back(sent_nodes[s]);
+            lane_words.push_back(word);
+        }
+        lane_scores.assign(lane_sents.size(), 0.0);
+        lm.score_batch(lane_nodes.data(), lane_words.data(), lane_scores.data(), lane_sents.size());
+        for (size_t l=0; l<lane_sents.size(); l++) {
+            int s = lane_sents[l];
+            sent_nodes[s] = lane_nodes[l];
+            int word_idx = sentences[s][pos];
+            if (word_idx == -1) continue;
+            double score = lane_scores[l];
+            if (class_lm && word_idx >= 0) score += vocab.entries[word_idx].class_lp;
+            if (token_scores != nullptr) (*token_scores)[s].push_back(score);
+            scores[s].ll += score;
+            scores[s].num_words++;
+        }
+    }
+}
+
+// Appends a line with the log likelihood, number of words and number
+// of OOVs of a sentence and optionally the token scores, tab separated
+static void
+append_sentence_score(std::string &out,
+                      const SentenceScore &score,
+                      const std::vector<double> *token_scores=nullptr)
 {
-    SimpleFileInput wcf(fname);
-
-    std::string line;
-    int max_class = 0;
-    while (wcf.getline(line)) {
-        std::stringstream ss(line);
-        std::string word;
-        int clss;
-        flt_type prob;
-        ss >> word >> clss >> prob;
-        class_memberships[word] = std::make_pair(clss, prob);
-        max_class = std::max(max_class, clss);
+    str::append_double(out, score.ll);
+    out += '\t';
+    str::append_int(out, score.num_words);
+    out += '\t';
+    str::append_int(out, score.num_oovs);
+    if (token_scores != nullptr) {
+        for (auto tit = token_scores->begin(); tit != token_scores->end(); ++tit) {
+            out += (tit == token_scores->begin()) ? '\t' : ' ';
+            if (std::isnan(*tit)) out += "OOV";
+            else str::append_double(out, *tit);
+        }
     }
-    return max_class+1;
+    out += '\n';
 }
 
+// Perplexity statistics of a batch of sentences and their formatted
+// scores. The scores are written when the batch is added to a total
+// with an output file, so they keep the input order.
+class ScoredBatch : public PplStats {
+public:
+    ScoredBatch(SimpleFileOutput *output_file=nullptr) : output_file(output_file) { }
+    void add(const ScoredBatch &other) {
+        PplStats::add(other);
+        if (output_file != nullptr) output_file->write(other.scores);
+    }
+    void add_sentence(const SentenceScore &score,
+                      bool write_scores,
+                      const std::vector<double> *token_scores=nullptr)
+    {
+        if (score.num_words > 0) {
+            num_words += score.num_words;
+            num_oovs += score.num_oovs;
+            total_ll += score.ll;
+            num_sents++;
+        }
+        if (write_scores) append_sentence_score(scores, score, token_scores);
+    }
+    std::string scores;
+    SimpleFileOutput *output_file;
+};
+
+// Appends a sentence with the words replaced by their classes, words
+// without a class by the unk symbol, and sentence boundaries added
+static void
+append_class_sentence(std::string &out,
+                      const std::string &line,
+                      const std::unordered_map<std::string, std::string> &word_classes,
+                      const std::string &unk)
+{
+    out += "<s>";
+    std::string token;
+    const char *ptr = line.c_str();
+    while (true) {
+        while (*ptr == ' ' || *ptr == '\t' || *ptr == '\n' || *ptr == '\r') ptr++;
+        if (*ptr == '\0') break;
+        const char *token_start = ptr;
+        while (*ptr != '\0' && *ptr != ' ' && *ptr != '\t' && *ptr != '\n' && *ptr != '\r') ptr++;
+        token.assign(token_start, ptr-token_start);
+        if (token == "<s>" || token == "</s>") continue;
+        out += ' ';
+        auto it = word_classes.find(token);
+        out += (it != word_classes.end()) ? it->second : unk;
+    }
+    out += " </s>\n";
+}
+
+// Class sequences of a batch of lines, written
+// to the output file in the input order
+class ClassBatch {
+public:
+    ClassBatch(SimpleFileOutput *output_file=nullptr) : output_file(output_file) { }
+    void add(const ClassBatch &other) {
+        if (output_file != nullptr) output_file->write(other.text);
+    }
+    std::string text;
+    SimpleFileOutput *output_file;
+};
+
 #endif /* PROJECT_DEFS */
@@ -4,6 +4,7 @@
 #include <ctime>
 
 #include "conf.hh"
+#include "io.hh"
 #include "ExchangeAlgorithm.hh"
 
 
@@ -22,11 +23,20 @@ int main(int argc, char* argv[])
         ('o', "top-words=INT", "arg", "0", "Own class in initialization for most common words, default: 0")
         ('p', "ll-print-interval=INT", "arg", "100000", "Likelihood print interval, default: 100000 (words)")
         ('w', "model-write-interval=INT", "arg", "3600", "Model write interval, default: 3600 (seconds)")
+        ('k', "keep-models=INT", "arg", "0", "Number of latest periodically written models to keep, default: 0 (all)")
+        ('z', "model-compression=STRING", "arg", "gz", "Compression of the model files: gz, zst or lz4, default: gz")
         ('v', "vocabulary=FILE", "arg", "", "Vocabulary, one word per line")
         ('i', "class-init=FILE", "arg", "", "Class initialization, same format as in model classes file")
+        ('x', "class-corpus=FILE", "arg", "", "Write the corpus mapped to classes to FILE after training")
+        ('d', "dev-corpus=FILE", "arg", "", "Development corpus to map to classes after training")
+        ('e', "dev-class-corpus=FILE", "arg", "", "Output file for the development corpus mapped to classes")
+        ('u', "unk=STRING", "arg", "<unk>", "Unk symbol in the class corpora, default: <unk>")
+        ('b', "count-memory=INT", "arg", "2048", "Memory for bigram counting in MB, sorted runs are merged from temporary files beyond this, default: 2048")
         ('h', "help", "", "", "display help");
         config.default_parse(argc, argv);
         if (config.arguments.size() != 2) config.print_help(stderr, 1);
+        if (config["dev-corpus"].specified != config["dev-class-corpus"].specified)
+            throw string("Define both dev-corpus and dev-class-corpus options");
 
         std::cerr << std::setprecision(10);
 
@@ -40,21 +50,43 @@ int main(int argc, char* argv[])
         int num_threads = config["num-threads"].get_int();
         int top_words = config["top-words"].get_int();
         int model_write_interval = config["model-write-interval"].get_int();
+        int keep_models = config["keep-models"].get_int();
         string vocab_fname = config["vocabulary"].get_str();
         string class_fname = config["class-init"].get_str();
+        size_t count_memory = (size_t)max(1, config["count-memory"].get_int()) * 1048576;
+        string model_compression = config["model-compression"].get_str();
+        if (model_compression != "gz" && model_compression != "zst" && model_compression != "lz4")
+            throw string("Unknown model compression: " + model_compression);
+        string model_suffix = ".cmemprobs." + model_compression;
+        if (!SimpleFileOutput::supported(model_suffix))
+            throw string("No support for model compression " + model_compression + " in this build");
+        for (auto opt : { "class-corpus", "dev-class-corpus" })
+            if (config[opt].specified && !SimpleFileOutput::supported(config[opt].get_str()))
+                throw string("No support for the compression of " + config[opt].get_str() + " in this build");
 
         Exchange e(num_classes, corpus_fname, vocab_fname,
-                   class_fname, top_words);
+                   class_fname, top_words, count_memory);
 
         time_t t1,t2;
         t1=time(0);
         cerr << "log likelihood: " << e.log_likelihood() << endl;
         e.iterate(max_iter, max_seconds, ll_print_interval,
-                  model_write_interval, model_fname, num_threads);
+                  model_write_interval, model_fname, num_threads, model_suffix, keep_models);
         t2=time(0);
         cerr << "Train run time: " << t2-t1 << " seconds" << endl;
 
-        e.write_class_mem_probs(model_fname + ".cmemprobs.gz");
+        e.write_class_mem_probs(model_fname + model_suffix);
+
+        string unk = config["unk"].get_str();
+        if (config["class-corpus"].specified) {
+            cerr << "Writing class corpus.." << endl;
+            e.write_class_corpus(corpus_fname, config["class-corpus"].get_str(), unk, num_threads);
+        }
+        if (config["dev-corpus"].specified) {
+            cerr << "Writing development class corpus.." << endl;
+            e.write_class_corpus(config["dev-corpus"].get_str(),
+                                 config["dev-class-corpus"].get_str(), unk, num_threads);
+        }
     } catch (string &e) {
         cerr << e << endl;
         exit(EXIT_FAILURE);
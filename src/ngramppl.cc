@@ -1,15 +1,84 @@
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <sstream>
 
 #include "str.hh"
 #include "defs.hh"
 #include "conf.hh"
+#include "parallel.hh"
 #include "Ngram.hh"
 
 using namespace std;
 
 
+void
+score_sentences(const LNNgram &lm,
+                NgramCache &cache,
+                const ScoringVocabulary &vocab,
+                bool root_unk_states,
+                bool write_scores,
+                bool write_token_scores,
+                const vector<string> &lines,
+                ScoredBatch &batch)
+{
+    vector<int> word_indices;
+    vector<double> token_scores;
+    for (auto lit = lines.begin(); lit != lines.end(); ++lit) {
+
+        SentenceScore sent_score;
+        token_scores.clear();
+        if (vocab.map_sentence(*lit, word_indices) == 0) {
+            batch.add_sentence(sent_score, write_scores, write_token_scores ? &token_scores : nullptr);
+            continue;
+        }
+
+        int node_id = lm.sentence_start_node;
+        for (auto wit=word_indices.begin(); wit != word_indices.end(); ++wit) {
+            if (*wit != -1) {
+                double score = 0.0;
+                node_id = cache.score(node_id, vocab.entries[*wit].word_lm_idx, score);
+                sent_score.ll += score;
+                sent_score.num_words++;
+                if (write_token_scores) token_scores.push_back(score);
+            }
+            else {
+                if (root_unk_states) node_id = lm.root_node; // SRILM
+                else node_id = cache.advance(node_id, lm.unk_symbol_idx); // VariKN style UNKs
+                sent_score.num_oovs++;
+                if (write_token_scores) token_scores.push_back(NAN);
+            }
+        }
+
+        double score = 0.0;
+        node_id = cache.score(node_id, lm.sentence_end_symbol_idx, score);
+        sent_score.ll += score;
+        sent_score.num_words++;
+        if (write_token_scores) token_scores.push_back(score);
+
+        batch.add_sentence(sent_score, write_scores, write_token_scores ? &token_scores : nullptr);
+    }
+}
+
+
+void
+score_sentences_interleaved(const LNNgram &lm,
+                            const ScoringVocabulary &vocab,
+                            bool root_unk_states,
+                            bool write_scores,
+                            bool write_token_scores,
+                            const vector<string> &lines,
+                            ScoredBatch &batch)
+{
+    vector<SentenceScore> scores;
+    vector<vector<double> > token_scores;
+    score_sentence_batch(lm, vocab, false, root_unk_states, lines, scores,
+                         write_token_scores ? &token_scores : nullptr);
+    for (size_t i=0; i<scores.size(); i++)
+        batch.add_sentence(scores[i], write_scores, write_token_scores ? &token_scores[i] : nullptr);
+}
+
+
 int main(int argc, char* argv[])
 {
     try {
@@ -17,6 +86,12 @@ int main(int argc, char* argv[])
         config("usage: ngramppl [OPTION...] ARPAFILE INPUT\n")
         ('r', "use-root-node", "", "", "Pass through root node in contexts with unks, DEFAULT: advance with unk symbol")
         ('w', "num-words=INT", "arg", "", "Number of words for computing word-normalized perplexity")
+        ('q', "quantize=INT", "arg", "", "Quantize probabilities to INT bits (1-16) in a compact model representation")
+        ('l', "hash-lookup", "", "", "Use hash tables instead of binary search for n-gram lookups")
+        ('t', "num-threads=INT", "arg", "1", "Number of scoring threads, default: 1")
+        ('c', "cache-bits=INT", "arg", "0", "Cache n-gram scores in 2^INT entries per thread, default: 0 (no cache)")
+        ('o', "score-output=FILE", "arg", "", "Write the log likelihood (ln), number of words and OOVs of each line to FILE")
+        ('k', "token-scores", "", "", "Write also the log probability of each token to the score output")
         ('h', "help", "", "", "display help");
         config.default_parse(argc, argv);
         if (config.arguments.size() != 2) config.print_help(stderr, 1);
@@ -24,71 +99,56 @@ int main(int argc, char* argv[])
         string arpafname = config.arguments[0];
         string infname = config.arguments[1];
 
-        string unk = "<unk>";
         bool root_unk_states = config["use-root-node"].specified;
+        int num_threads = config["num-threads"].get_int();
 
         LNNgram lm;
-        lm.read_arpa(arpafname);
+        lm.read(arpafname);
+        if (config["quantize"].specified) lm.quantize(config["quantize"].get_int());
+        if (config["hash-lookup"].specified) lm.use_hash_lookup();
 
-        SimpleFileInput infile(infname);
-        string line;
-        long int num_words = 0;
-        long int num_sents = 0;
-        long int num_oov = 0;
-        double total_ll = 0.0;
-        int linei = 0;
-        while (infile.getline(line)) {
-
-            line = str::cleaned(line);
-            if (line.length() == 0) continue;
-            if (++linei % 10000 == 0) cerr << "sentence " << linei << endl;
-
-            stringstream ss(line);
-            vector<string> words;
-            string word;
-            while (ss >> word) {
-                if (word == "<s>") continue;
-                if (word == "</s>") continue;
-                words.push_back(word);
-            }
-            words.push_back(lm.sentence_end_symbol);
+        ScoringVocabulary vocab;
+        for (int i=0; i<(int)lm.vocabulary.size(); i++)
+            if (i != lm.unk_symbol_idx)
+                vocab.add(lm.vocabulary[i], ScoringVocabulary::Entry(i));
 
-            double sent_ll = 0.0;
-            int node_id = lm.sentence_start_node;
-            for (auto wit=words.begin(); wit != words.end(); ++wit) {
-                double score = 0.0;
-                if (lm.vocabulary_lookup.find(*wit) != lm.vocabulary_lookup.end()
-                    && lm.vocabulary_lookup.at(*wit) != lm.unk_symbol_idx)
-                {
-                    int sym = lm.vocabulary_lookup[*wit];
-                    node_id = lm.score(node_id, sym, score);
-                    sent_ll += score;
-                    num_words++;
-                }
-                else {
-                    if (root_unk_states) node_id = lm.root_node; // SRILM
-                    else node_id = lm.advance(node_id, lm.unk_symbol_idx); // VariKN style UNKs
-                    num_oov++;
-                }
-            }
+        int cache_bits = config["cache-bits"].get_int();
+        vector<NgramCache> caches(max(num_threads, 1), NgramCache(lm, cache_bits));
 
-            total_ll += sent_ll;
-            num_sents++;
-        }
+        bool write_scores = config["score-output"].specified;
+        bool write_token_scores = write_scores && config["token-scores"].specified;
+        unique_ptr<SimpleFileOutput> scorefile;
+        if (write_scores) scorefile.reset(new SimpleFileOutput(config["score-output"].get_str()));
+
+        SimpleFileInput infile(infname);
+        ScoredBatch stats(scorefile.get());
+        process_lines<ScoredBatch>(infile, num_threads,
+            [&](const vector<string> &lines, ScoredBatch &batch, int thread_idx) {
+                if (cache_bits > 0)
+                    score_sentences(lm, caches[thread_idx], vocab, root_unk_states,
+                                    write_scores, write_token_scores, lines, batch);
+                else
+                    score_sentences_interleaved(lm, vocab, root_unk_states,
+                                                write_scores, write_token_scores, lines, batch);
+            },
+            stats, 1000, 10000);
+        if (scorefile) scorefile->close();
 
         cerr << endl;
-        cerr << "Number of sentences: " << num_sents << endl;
-        cerr << "Number of in-vocabulary words exluding sentence ends: " << num_words-num_sents << endl;
-        cerr << "Number of in-vocabulary words including sentence ends: " << num_words << endl;
-        cerr << "Number of OOV words: " << num_oov << endl;
-        cerr << "Total log likelihood (ln): " << total_ll << endl;
-        cerr << "Total log likelihood (log10): " << total_ll/2.302585092994046 << endl;
-
-        double ppl = exp(-1.0/double(num_words) * total_ll);
+        cerr << "Number of sentences: " << stats.num_sents << endl;
+        cerr << "Number of in-vocabulary words exluding sentence ends: " << stats.num_words-stats.num_sents << endl;
+        cerr << "Number of in-vocabulary words including sentence ends: " << stats.num_words << endl;
+        cerr << "Number of OOV words: " << stats.num_oovs << endl;
+        cerr << "Total log likelihood (ln): " << stats.total_ll << endl;
+        cerr << "Total log likelihood (log10): " << stats.total_ll/2.302585092994046 << endl;
+
+        double ppl = exp(-1.0/double(stats.num_words) * stats.total_ll);
         cerr << "Perplexity: " << ppl << endl;
+        if (cache_bits > 0)
+            cerr << "N-gram cache hit rate: " << cache_hit_rate(caches) << endl;
 
         if (config["num-words"].specified) {
-            double wnppl = exp(-1.0/double(config["num-words"].get_int()) * total_ll);
+            double wnppl = exp(-1.0/double(config["num-words"].get_int()) * stats.total_ll);
             cerr << "Word-normalized perplexity: " << wnppl << endl;
         }
 
@@ -0,0 +1,415 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "str.hh"
+#include "defs.hh"
+#include "ClassMemberships.hh"
+#include "conf.hh"
+#include "Ngram.hh"
+
+using namespace std;
+
+
+// One connection, or stdin/stdout. Responses are written by a writer
+// thread of the client so that a slow client does not stall the others.
+// Reading waits while too many requests of the client are unanswered.
+// The descriptors are closed when the last pending request of the
+// connection has been answered.
+class Client {
+public:
+    Client(int in_fd, int out_fd, bool close_fds)
+        : in_fd(in_fd), out_fd(out_fd), close_fds(close_fds),
+          num_pending(0), reading_done(false), write_failed(false) { }
+    ~Client() {
+        if (!close_fds) return;
+        close(in_fd);
+        if (out_fd != in_fd) close(out_fd);
+    }
+    void add_pending(int num_lines, int max_pending);
+    void send(string &data, int num_lines);
+    void finish_reading();
+    void write_responses();
+    int in_fd;
+    int out_fd;
+    bool close_fds;
+
+private:
+    bool write_all(const string &data);
+
+    mutex mtx;
+    condition_variable changed;
+    deque<pair<string, int> > responses;
+    int num_pending;
+    bool reading_done;
+    bool write_failed;
+};
+
+
+void
+Client::add_pending(int num_lines, int max_pending)
+{
+    unique_lock<mutex> lock(mtx);
+    changed.wait(lock, [&]() { return num_pending < max_pending; });
+    num_pending += num_lines;
+}
+
+
+void
+Client::send(string &data, int num_lines)
+{
+    lock_guard<mutex> lock(mtx);
+    responses.push_back(make_pair(string(), num_lines));
+    responses.back().first.swap(data);
+    changed.notify_all();
+}
+
+
+void
+Client::finish_reading()
+{
+    lock_guard<mutex> lock(mtx);
+    reading_done = true;
+    changed.notify_all();
+}
+
+
+// Writes responses until all requests have been answered. After a
+// failed write the responses are discarded.
+void
+Client::write_responses()
+{
+    unique_lock<mutex> lock(mtx);
+    while (true) {
+        changed.wait(lock, [&]() { return responses.size() > 0 || (reading_done && num_pending == 0); });
+        if (responses.empty()) return;
+        string data;
+        data.swap(responses.front().first);
+        int num_lines = responses.front().second;
+        responses.pop_front();
+        lock.unlock();
+        if (!write_failed) write_failed = !write_all(data);
+        lock.lock();
+        num_pending -= num_lines;
+        changed.notify_all();
+    }
+}
+
+
+bool
+Client::write_all(const string &data)
+{
+    const char *ptr = data.c_str();
+    size_t left = data.size();
+    while (left > 0) {
+        ssize_t written = write(out_fd, ptr, left);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        ptr += written;
+        left -= written;
+    }
+    return true;
+}
+
+
+class Request {
+public:
+    shared_ptr<Client> client;
+    string line;
+};
+
+
+// Requests from all clients in arrival order. The scoring thread
+// takes everything pending at once, so concurrent requests are
+// scored in the same batch. Pushing waits while the queue is full.
+class RequestQueue {
+public:
+    RequestQueue(int max_size) : num_readers(0), max_size(max_size) { }
+    void push(const shared_ptr<Client> &client, vector<string> &lines);
+    bool take(vector<Request> &batch, int max_batch_size);
+    void reader_started();
+    void reader_done();
+
+    mutex mtx;
+    condition_variable requests_ready;
+    condition_variable space_ready;
+    deque<Request> requests;
+    int num_readers;
+    int max_size;
+};
+
+
+void
+RequestQueue::push(const shared_ptr<Client> &client, vector<string> &lines)
+{
+    unique_lock<mutex> lock(mtx);
+    space_ready.wait(lock, [&]() { return (int)requests.size() < max_size; });
+    for (auto lit = lines.begin(); lit != lines.end(); ++lit) {
+        requests.push_back(Request());
+        requests.back().client = client;
+        requests.back().line.swap(*lit);
+    }
+    requests_ready.notify_one();
+}
+
+
+bool
+RequestQueue::take(vector<Request> &batch, int max_batch_size)
+{
+    batch.clear();
+    unique_lock<mutex> lock(mtx);
+    requests_ready.wait(lock, [&]() { return requests.size() > 0 || num_readers == 0; });
+    while (requests.size() > 0 && (int)batch.size() < max_batch_size) {
+        batch.push_back(Request());
+        batch.back().client.swap(requests.front().client);
+        batch.back().line.swap(requests.front().line);
+        requests.pop_front();
+    }
+    space_ready.notify_all();
+    return batch.size() > 0;
+}
+
+
+void
+RequestQueue::reader_started()
+{
+    lock_guard<mutex> lock(mtx);
+    num_readers++;
+}
+
+
+void
+RequestQueue::reader_done()
+{
+    lock_guard<mutex> lock(mtx);
+    num_readers--;
+    requests_ready.notify_one();
+}
+
+
+// Reads the lines sent by a client and queues them, the responses are
+// written by a separate thread
+void
+read_requests(shared_ptr<Client> client, RequestQueue &queue, int max_pending)
+{
+    thread writer(&Client::write_responses, client);
+    vector<char> buffer(65536);
+    string partial;
+    vector<string> lines;
+    while (true) {
+        ssize_t num_read = read(client->in_fd, buffer.data(), buffer.size());
+        if (num_read < 0 && errno == EINTR) continue;
+        if (num_read <= 0) break;
+        const char *ptr = buffer.data();
+        const char *end = ptr + num_read;
+        while (ptr < end) {
+            const char *newline = (const char*)memchr(ptr, '\n', end-ptr);
+            if (newline == nullptr) {
+                partial.append(ptr, end-ptr);
+                break;
+            }
+            partial.append(ptr, newline-ptr);
+            lines.push_back(string());
+            lines.back().swap(partial);
+            ptr = newline+1;
+        }
+        if (lines.size() > 0) {
+            client->add_pending(lines.size(), max_pending);
+            queue.push(client, lines);
+            lines.clear();
+        }
+    }
+    if (partial.size() > 0) {
+        lines.push_back(partial);
+        client->add_pending(lines.size(), max_pending);
+        queue.push(client, lines);
+    }
+    client->finish_reading();
+    writer.join();
+    client.reset();
+    queue.reader_done();
+}
+
+
+// Scores queued requests until all readers are done
+void
+score_requests(const LNNgram &lm,
+               const ScoringVocabulary &vocab,
+               bool class_lm,
+               bool root_unk_states,
+               bool write_token_scores,
+               RequestQueue &queue,
+               int max_batch_size)
+{
+    vector<Request> batch;
+    vector<string> lines;
+    vector<SentenceScore> scores;
+    vector<vector<double> > token_scores;
+    map<Client*, pair<string, int> > responses;
+    while (queue.take(batch, max_batch_size)) {
+        lines.resize(batch.size());
+        for (size_t i=0; i<batch.size(); i++)
+            lines[i].swap(batch[i].line);
+        score_sentence_batch(lm, vocab, class_lm, root_unk_states, lines, scores,
+                             write_token_scores ? &token_scores : nullptr);
+
+        // Responses are collected per client to write each at once
+        responses.clear();
+        for (size_t i=0; i<batch.size(); i++) {
+            pair<string, int> &response = responses[batch[i].client.get()];
+            append_sentence_score(response.first, scores[i],
+                                  write_token_scores ? &token_scores[i] : nullptr);
+            response.second++;
+        }
+        for (auto rit = responses.begin(); rit != responses.end(); ++rit)
+            rit->first->send(rit->second.first, rit->second.second);
+    }
+}
+
+
+int
+open_socket(string socket_path)
+{
+    struct sockaddr_un address;
+    if (socket_path.length() >= sizeof(address.sun_path))
+        throw string("Socket path too long: " + socket_path);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path)-1);
+
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0) throw string("Problem creating socket: ") + strerror(errno);
+    // Only a stale socket is removed, never another file
+    struct stat path_stat;
+    if (lstat(socket_path.c_str(), &path_stat) == 0) {
+        if (!S_ISSOCK(path_stat.st_mode))
+            throw string("Socket path exists and is not a socket: " + socket_path);
+        unlink(socket_path.c_str());
+    }
+    if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+        throw string("Problem binding socket " + socket_path + ": ") + strerror(errno);
+    if (listen(server_fd, 64) < 0)
+        throw string("Problem listening on socket " + socket_path + ": ") + strerror(errno);
+    return server_fd;
+}
+
+
+int main(int argc, char* argv[])
+{
+    try {
+        conf::Config config;
+        config("usage: ngramserver [OPTION...] ARPAFILE\n"
+               "Reads one sentence per line and writes the log likelihood (ln),\n"
+               "the number of scored words including the sentence end and the\n"
+               "number of OOV words for each, tab separated, optionally followed\n"
+               "by the token scores.\n")
+        ('m', "class-memberships=FILE", "arg", "", "Score with a class n-gram model using these class memberships")
+        ('s', "socket=PATH", "arg", "", "Serve clients on a UNIX socket, DEFAULT: stdin and stdout")
+        ('r', "use-root-node", "", "", "Pass through root node in contexts with unks, DEFAULT: advance with unk symbol")
+        ('k', "token-scores", "", "", "Write also the log probability of each token")
+        ('q', "quantize=INT", "arg", "", "Quantize probabilities to INT bits (1-16) in a compact model representation")
+        ('l', "hash-lookup", "", "", "Use hash tables instead of binary search for n-gram lookups")
+        ('b', "batch-size=INT", "arg", "1000", "Maximum number of sentences scored in one batch, default: 1000")
+        ('h', "help", "", "", "display help");
+        config.default_parse(argc, argv);
+        if (config.arguments.size() != 1) config.print_help(stderr, 1);
+
+        string lmfname = config.arguments[0];
+        bool class_lm = config["class-memberships"].specified;
+        bool root_unk_states = config["use-root-node"].specified;
+        bool write_token_scores = config["token-scores"].specified;
+        int batch_size = max(1, config["batch-size"].get_int());
+
+        ClassMemberships class_memberships;
+        if (class_lm) {
+            cerr << "Reading class memberships.." << endl;
+            class_memberships.read(config["class-memberships"].get_str());
+        }
+
+        cerr << "Reading n-gram model.." << endl;
+        LNNgram lm;
+        lm.read(lmfname);
+        if (config["quantize"].specified) lm.quantize(config["quantize"].get_int());
+        if (config["hash-lookup"].specified) lm.use_hash_lookup();
+
+        ScoringVocabulary vocab;
+        if (class_lm) {
+            // The class indexes are stored as strings in the n-gram class,
+            // words of classes missing from the model are OOVs
+            vector<int> indexmap(class_memberships.num_classes, -1);
+            for (int i=0; i<(int)indexmap.size(); i++)
+                if (lm.vocabulary_lookup.find(int2str(i)) != lm.vocabulary_lookup.end())
+                    indexmap[i] = lm.vocabulary_lookup[int2str(i)];
+            for (int i=0; i<class_memberships.size(); i++) {
+                string word = class_memberships.word(i);
+                if (word == "<unk>" || word == "<UNK>") continue;
+                int class_idx = indexmap[class_memberships.word_class(i)];
+                if (class_idx == -1) continue;
+                vocab.add(word, ScoringVocabulary::Entry(-1, class_idx, class_memberships.log_prob(i)));
+            }
+            class_memberships.clear();
+        }
+        else {
+            for (int i=0; i<(int)lm.vocabulary.size(); i++)
+                if (i != lm.unk_symbol_idx)
+                    vocab.add(lm.vocabulary[i], ScoringVocabulary::Entry(i));
+        }
+
+        // Clients may disconnect before their responses are written
+        signal(SIGPIPE, SIG_IGN);
+
+        // Requests waiting for scoring and unanswered requests per client
+        RequestQueue queue(4*batch_size);
+        int max_client_pending = 4*batch_size;
+        if (!config["socket"].specified) {
+            cerr << "Reading sentences from standard input.." << endl;
+            queue.reader_started();
+            thread reader(read_requests, make_shared<Client>(0, 1, false), ref(queue),
+                          max_client_pending);
+            score_requests(lm, vocab, class_lm, root_unk_states, write_token_scores, queue, batch_size);
+            reader.join();
+            exit(EXIT_SUCCESS);
+        }
+
+        string socket_path = config["socket"].get_str();
+        int server_fd = open_socket(socket_path);
+        cerr << "Listening on " << socket_path << endl;
+
+        // The acceptor counts as a reader so that scoring never stops
+        queue.reader_started();
+        thread scorer(score_requests, cref(lm), cref(vocab), class_lm, root_unk_states,
+                      write_token_scores, ref(queue), batch_size);
+        while (true) {
+            int client_fd = accept(server_fd, nullptr, nullptr);
+            if (client_fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                cerr << "Problem accepting connection: " << strerror(errno) << endl;
+                break;
+            }
+            queue.reader_started();
+            thread reader(read_requests, make_shared<Client>(client_fd, client_fd, true), ref(queue),
+                          max_client_pending);
+            reader.detach();
+        }
+        close(server_fd);
+        queue.reader_done();
+        scorer.join();
+        exit(EXIT_FAILURE);
+
+    } catch (string &e) {
+        cerr << e << endl;
+        exit(EXIT_FAILURE);
+    }
+}
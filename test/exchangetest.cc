@@ -1,6 +1,8 @@
 #define BOOST_TEST_MODULE Hello
 #include <boost/test/unit_test.hpp>
 
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <vector>
 #include <map>
@@ -10,6 +12,7 @@
 #define private public
 #include "ExchangeAlgorithm.hh"
 #undef private
+#include "ClassMemberships.hh"
 
 using namespace std;
 
@@ -73,13 +76,57 @@ BOOST_AUTO_TEST_CASE(DataRead)
     BOOST_CHECK_EQUAL( num_classes+2, e.m_classes.size() );
     BOOST_CHECK_EQUAL( num_words, e.m_word_classes.size() );
     BOOST_CHECK_EQUAL( num_words, e.m_word_counts.size() );
-    BOOST_CHECK_EQUAL( num_words, e.m_word_bigram_counts.size() );
-    BOOST_CHECK_EQUAL( num_words, e.m_word_rev_bigram_counts.size() );
+    BOOST_CHECK_EQUAL( (int)num_words, e.m_word_bigram_counts.num_rows() );
+    BOOST_CHECK_EQUAL( (int)num_words, e.m_word_rev_bigram_counts.num_rows() );
     BOOST_CHECK_EQUAL( num_classes+2, e.m_class_counts.size() );
     BOOST_CHECK_EQUAL( num_classes+2, e.m_class_bigram_counts.size() );
 }
 
 
+// Test that bigram counts merged from temporary files match the in-memory counts
+BOOST_AUTO_TEST_CASE(ExternalCounts)
+{
+    cerr << endl;
+    Exchange e1(2, "test/corpus1.txt");
+    Exchange e2(2, "test/corpus1.txt", "", "", 0, 64);
+    assert_same(e1, e2);
+
+    string fname = "test/exchangetest.tmp.corpus.txt";
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> wuni(0, 300);
+    map<pair<string, string>, int> bigram_counts;
+    {
+        ofstream corpusf(fname);
+        for (int i=0; i<2000; i++) {
+            string prev = "<s>";
+            for (int j=0; j<10; j++) {
+                string word = "w" + to_string(wuni(rng));
+                corpusf << word << " ";
+                bigram_counts[make_pair(prev, word)]++;
+                prev = word;
+            }
+            corpusf << endl;
+            bigram_counts[make_pair(prev, string("</s>"))]++;
+        }
+    }
+
+    Exchange e3(10, fname);
+    Exchange e4(10, fname, "", "", 0, 4096);
+    assert_same(e3, e4);
+    int num_bigrams = 0;
+    for (int w1=0; w1<e4.m_word_bigram_counts.num_rows(); w1++) {
+        for (auto bgit = e4.m_word_bigram_counts.begin(w1); bgit != e4.m_word_bigram_counts.end(w1); ++bgit) {
+            BOOST_CHECK_EQUAL( bigram_counts[make_pair(e4.m_vocabulary[w1], e4.m_vocabulary[bgit->first])], bgit->second );
+            BOOST_CHECK_EQUAL( bgit->second, e4.m_word_rev_bigram_counts.count(bgit->first, w1) );
+            num_bigrams++;
+        }
+    }
+    BOOST_CHECK_EQUAL( (int)bigram_counts.size(), num_bigrams );
+
+    remove(fname.c_str());
+}
+
+
 // Test that moving words between classes handles counts correctly
 BOOST_AUTO_TEST_CASE(DoExchange)
 {
@@ -187,6 +234,46 @@ BOOST_AUTO_TEST_CASE(EvalExchange2)
 }
 
 
+// Test that class memberships read the same from text and binary files
+BOOST_AUTO_TEST_CASE(ClassMembershipsBinary)
+{
+    cerr << endl;
+    Exchange e(2, "test/corpus1.txt");
+    string text_fname = "test/exchangetest.tmp.cmemprobs.gz";
+    string binary_fname = "test/exchangetest.tmp.cmemprobs.bin";
+    e.write_class_mem_probs(text_fname);
+
+    ClassMemberships text;
+    text.read(text_fname);
+    BOOST_CHECK( !ClassMemberships::is_binary(text_fname) );
+    BOOST_CHECK_EQUAL( e.m_vocabulary.size()-3, (long unsigned int)text.size() );
+    text.write_binary(binary_fname);
+
+    ClassMemberships binary;
+    binary.read(binary_fname);
+    BOOST_CHECK( ClassMemberships::is_binary(binary_fname) );
+    BOOST_CHECK_EQUAL( text.num_classes, binary.num_classes );
+    BOOST_REQUIRE_EQUAL( text.size(), binary.size() );
+    for (int i=0; i<text.size(); i++) {
+        BOOST_CHECK_EQUAL( text.word(i), binary.word(i) );
+        BOOST_CHECK_EQUAL( text.word_class(i), binary.word_class(i) );
+        BOOST_CHECK_EQUAL( text.log_prob(i), binary.log_prob(i) );
+        int widx = e.m_vocabulary_lookup[text.word(i)];
+        BOOST_CHECK_EQUAL( e.m_word_classes[widx]-e.m_num_special_classes, text.word_class(i) );
+    }
+
+    // Initialization from the binary file gives the same classes
+    Exchange e2(2, "test/corpus1.txt", "", binary_fname);
+    for (unsigned int w1=0; w1<e.m_vocabulary.size(); w1++)
+        for (unsigned int w2=0; w2<e.m_vocabulary.size(); w2++)
+            BOOST_CHECK_EQUAL( e.m_word_classes[w1] == e.m_word_classes[w2],
+                               e2.m_word_classes[w1] == e2.m_word_classes[w2] );
+
+    remove(text_fname.c_str());
+    remove(binary_fname.c_str());
+}
+
+
 // Test for checking evaluation time
 BOOST_AUTO_TEST_CASE(EvalExchangeTime)
 {
@@ -0,0 +1,53 @@
+#include <boost/test/unit_test.hpp>
+
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "defs.hh"
+
+using namespace std;
+
+
+// Test that EM recovers the weights of a three component mixture
+BOOST_AUTO_TEST_CASE(OptimizeInterpolationWeights)
+{
+    cerr << endl;
+
+    double probs[3][4] = { { 0.7, 0.1, 0.1, 0.1 },
+                           { 0.1, 0.7, 0.1, 0.1 },
+                           { 0.1, 0.1, 0.4, 0.4 } };
+    double true_weights[3] = { 0.2, 0.5, 0.3 };
+
+    std::mt19937 rng(1);
+    std::discrete_distribution<int> component_dist(true_weights, true_weights+3);
+    vector<std::discrete_distribution<int> > symbol_dists;
+    for (int c=0; c<3; c++)
+        symbol_dists.push_back(std::discrete_distribution<int>(probs[c], probs[c]+4));
+
+    vector<vector<float> > component_lps(3);
+    for (int t=0; t<50000; t++) {
+        int symbol = symbol_dists[component_dist(rng)](rng);
+        for (int c=0; c<3; c++)
+            component_lps[c].push_back(log(probs[c][symbol]));
+    }
+
+    vector<double> weights;
+    double ll = optimize_interpolation_weights(component_lps, weights, 1000, 1e-10);
+
+    BOOST_CHECK_EQUAL( 3, (int)weights.size() );
+    BOOST_CHECK_CLOSE( 1.0, weights[0]+weights[1]+weights[2], 0.0001 );
+    for (int c=0; c<3; c++)
+        BOOST_CHECK( fabs(weights[c]-true_weights[c]) < 0.05 );
+
+    vector<double> uniform_weights(3, 1.0/3.0);
+    double uniform_ll = optimize_interpolation_weights(component_lps, uniform_weights, 1);
+    BOOST_CHECK( ll > uniform_ll );
+
+    vector<vector<float> > empty_lps(2);
+    vector<double> init_weights = { 0.3, 0.7 };
+    BOOST_CHECK_EQUAL( 0.0, optimize_interpolation_weights(empty_lps, init_weights) );
+    BOOST_CHECK_EQUAL( 0.3, init_weights[0] );
+    BOOST_CHECK_EQUAL( 0.7, init_weights[1] );
+}
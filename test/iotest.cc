@@ -0,0 +1,255 @@
+#include <boost/test/unit_test.hpp>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "io.hh"
+#include "str.hh"
+
+using namespace std;
+
+
+// Writes test lines, the last one without a newline
+static void
+write_lines(string fname, const vector<string> &lines)
+{
+    SimpleFileOutput outf(fname);
+    for (unsigned int i=0; i<lines.size(); i++) {
+        outf << lines[i];
+        if (i+1 < lines.size()) outf << "\r\n";
+    }
+    outf.close();
+}
+
+
+static vector<string>
+test_lines()
+{
+    vector<string> lines;
+    lines.push_back("a b c");
+    lines.push_back("");
+    lines.push_back(string(3000000, 'x'));
+    lines.push_back("d e");
+    for (int i=0; i<100000; i++)
+        lines.push_back("line " + to_string(i));
+    lines.push_back("last");
+    return lines;
+}
+
+
+// Test files of all the compressions built in
+static vector<string>
+test_fnames()
+{
+    vector<string> fnames = { "test/iotest.tmp.txt", "test/iotest.tmp.txt.gz" };
+#ifdef HAVE_ZSTD
+    fnames.push_back("test/iotest.tmp.txt.zst");
+#endif
+#ifdef HAVE_LZ4
+    fnames.push_back("test/iotest.tmp.txt.lz4");
+#endif
+    return fnames;
+}
+
+
+// Test reading plain and compressed lines with and without the background thread
+BOOST_AUTO_TEST_CASE(ReadLines)
+{
+    cerr << endl;
+    vector<string> lines = test_lines();
+    vector<string> fnames = test_fnames();
+    for (auto fit = fnames.begin(); fit != fnames.end(); ++fit) {
+        write_lines(*fit, lines);
+
+        for (int background=0; background<2; background++) {
+            SimpleFileInput inf(*fit, background);
+            string line;
+            unsigned int linei = 0;
+            while (inf.getline(line)) {
+                BOOST_REQUIRE( linei < lines.size() );
+                BOOST_CHECK( lines[linei] == line );
+                linei++;
+            }
+            BOOST_CHECK_EQUAL( lines.size(), linei );
+        }
+
+        SimpleFileInput inf2(*fit);
+        const char *data;
+        size_t size;
+        BOOST_REQUIRE( inf2.getline(data, size) );
+        BOOST_CHECK_EQUAL( "a b c", string(data, size) );
+
+        remove(fit->c_str());
+    }
+}
+
+
+// Compresses text to a gzip member, level 0 stores the data as is
+static string
+gzip_member(const string &text, int level)
+{
+    string fname = "test/iotest.tmp.member.gz";
+    gzFile gzf = gzopen(fname.c_str(), ("wb" + to_string(level)).c_str());
+    gzwrite(gzf, text.data(), text.size());
+    gzclose(gzf);
+    MemoryMappedFile mapped(fname);
+    string member(mapped.data(), mapped.size());
+    remove(fname.c_str());
+    return member;
+}
+
+
+static string
+read_all(FileInputType &input)
+{
+    string text;
+    vector<char> buffer(12345);
+    size_t num_read;
+    while ((num_read = input.read(buffer.data(), buffer.size())) > 0)
+        text.append(buffer.data(), num_read);
+    return text;
+}
+
+
+// Test decompressing gzip members in parallel
+BOOST_AUTO_TEST_CASE(ParallelGZip)
+{
+    cerr << endl;
+    string fname = "test/iotest.tmp.multi.gz";
+    string text, compressed;
+    for (int m=0; m<20; m++) {
+        string member_text;
+        for (int i=0; i<m*5000; i++)
+            member_text += "member " + to_string(m) + " line " + to_string(i) + "\n";
+        // A gzip header inside stored data is not a member boundary
+        if (m == 7) member_text += string("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03", 10) + "\n";
+        text += member_text;
+        compressed += gzip_member(member_text, m == 7 ? 0 : 6);
+    }
+    ofstream(fname, ios_base::binary).write(compressed.data(), compressed.size());
+
+    shared_ptr<MemoryMappedFile> file = make_shared<MemoryMappedFile>(fname);
+    for (size_t segment_size=1; segment_size<10000000; segment_size*=100) {
+        ParallelGZipInput input(file, 3, segment_size);
+        BOOST_CHECK( text == read_all(input) );
+    }
+
+    SimpleFileInput inf(fname, true, 3);
+    string line, lines;
+    while (inf.getline(line)) lines += line + "\n";
+    BOOST_CHECK( text == lines );
+
+    ofstream(fname, ios_base::binary).write(compressed.data(), compressed.size()-100);
+    file = make_shared<MemoryMappedFile>(fname);
+    ParallelGZipInput truncated(file, 3, 1000);
+    BOOST_CHECK_THROW( read_all(truncated), string );
+
+    remove(fname.c_str());
+}
+
+
+// Test that written numbers read back to the same values
+BOOST_AUTO_TEST_CASE(WriteValues)
+{
+    cerr << endl;
+    vector<float> values = { 0.0f, -1.5f, -2.6675f, 1e-7f, 3e20f, 100.0f, -0.30103f };
+    for (int i=0; i<100000; i++)
+        values.push_back(-8.0f * i / 99999.0f + 1e-9f * i);
+
+    vector<string> fnames = test_fnames();
+    for (auto fit = fnames.begin(); fit != fnames.end(); ++fit) {
+        SimpleFileOutput outf(*fit);
+        for (unsigned int i=0; i<values.size(); i++)
+            outf << (int)i << " " << (long unsigned int)i << "\t" << values[i] << "\n";
+        outf.close();
+
+        SimpleFileInput inf(*fit);
+        string line;
+        unsigned int linei = 0;
+        while (inf.getline(line)) {
+            BOOST_REQUIRE( linei < values.size() );
+            BOOST_CHECK_EQUAL( to_string(linei) + " " + to_string(linei), line.substr(0, line.find('\t')) );
+            BOOST_CHECK_EQUAL( values[linei], strtof(line.c_str() + line.find('\t') + 1, NULL) );
+            linei++;
+        }
+        BOOST_CHECK_EQUAL( values.size(), linei );
+        remove(fit->c_str());
+    }
+
+    string formatted;
+    str::append_shortest(formatted, -2.6675f);
+    BOOST_CHECK_EQUAL( "-2.6675", formatted );
+
+    // Doubles are written with six decimals
+    formatted.clear();
+    str::append_double(formatted, -1.1938717);
+    formatted += " ";
+    str::append_double(formatted, 0.0);
+    BOOST_CHECK_EQUAL( "-1.193872 0.000000", formatted );
+}
+
+
+// Test that an error in flushing the compressed output is reported on close
+BOOST_AUTO_TEST_CASE(GZipCloseError)
+{
+    cerr << endl;
+    GZipFileOutput outf("/dev/full");
+    outf.write("a b c\n", 6);
+    BOOST_CHECK_THROW( outf.close(), string );
+    outf.close();
+}
+
+
+// Test that compressions missing from the build are reported
+BOOST_AUTO_TEST_CASE(SupportedOutput)
+{
+    cerr << endl;
+    BOOST_CHECK( SimpleFileOutput::supported("test/iotest.tmp.txt") );
+    BOOST_CHECK( SimpleFileOutput::supported("test/iotest.tmp.txt.gz") );
+#ifdef HAVE_ZSTD
+    BOOST_CHECK( SimpleFileOutput::supported("test/iotest.tmp.txt.zst") );
+#else
+    BOOST_CHECK( !SimpleFileOutput::supported("test/iotest.tmp.txt.zst") );
+#endif
+#ifdef HAVE_LZ4
+    BOOST_CHECK( SimpleFileOutput::supported("test/iotest.tmp.txt.lz4") );
+#else
+    BOOST_CHECK( !SimpleFileOutput::supported("test/iotest.tmp.txt.lz4") );
+#endif
+}
+
+
+// Test the fixed precision number formatting of the score output
+BOOST_AUTO_TEST_CASE(FormatScores)
+{
+    cerr << endl;
+    mt19937 gen(1);
+    uniform_real_distribution<double> dist(-200.0, 10.0);
+    char buf[64];
+    for (int i=0; i<10000; i++) {
+        double value = dist(gen);
+        if (i % 4 == 0) value /= 1000.0;
+        string formatted;
+        str::append_double(formatted, value);
+        snprintf(buf, sizeof(buf), "%.6f", value);
+        BOOST_CHECK_CLOSE( atof(buf), atof(formatted.c_str()), 1e-7 );
+        BOOST_CHECK( fabs(atof(formatted.c_str())-value) <= 0.5e-6 + 1e-12 );
+    }
+
+    string formatted;
+    str::append_double(formatted, -1.5, 2);
+    formatted += ' ';
+    str::append_double(formatted, 0.0, 0);
+    formatted += ' ';
+    str::append_int(formatted, -1234567);
+    formatted += ' ';
+    str::append_int(formatted, 0);
+    BOOST_CHECK_EQUAL( "-1.50 0 -1234567 0", formatted );
+}
@@ -0,0 +1,300 @@
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Ngram.hh"
+
+using namespace std;
+
+
+vector<int>
+to_indices(const Ngram &lm, string sent)
+{
+    vector<int> words;
+    stringstream ss(sent);
+    string word;
+    while (ss >> word)
+        words.push_back(lm.vocabulary_lookup.at(word));
+    return words;
+}
+
+
+double
+sentence_score(const Ngram &lm, string sent)
+{
+    vector<int> words = to_indices(lm, sent);
+    double score = 0.0;
+    int node_idx = lm.sentence_start_node;
+    for (auto wit=words.begin(); wit != words.end(); ++wit)
+        node_idx = lm.score(node_idx, *wit, score);
+    return score;
+}
+
+
+void
+assert_same_scores(const Ngram &lm1,
+                   const Ngram &lm2)
+{
+    BOOST_CHECK( lm1.vocabulary == lm2.vocabulary );
+    BOOST_CHECK_EQUAL( lm1.max_order, lm2.max_order );
+    BOOST_CHECK_EQUAL( lm1.sentence_start_node, lm2.sentence_start_node );
+    BOOST_CHECK_EQUAL( lm1.sentence_end_symbol_idx, lm2.sentence_end_symbol_idx );
+    BOOST_CHECK_EQUAL( lm1.unk_symbol_idx, lm2.unk_symbol_idx );
+    BOOST_CHECK( lm1.ngram_counts_per_order == lm2.ngram_counts_per_order );
+
+    for (int n=0; n<(int)lm1.nodes.size(); n++) {
+        for (int w=0; w<(int)lm1.vocabulary.size(); w++) {
+            double score1 = 0.0, score2 = 0.0;
+            int node1 = lm1.score(n, w, score1);
+            int node2 = lm2.score(n, w, score2);
+            BOOST_CHECK_EQUAL( node1, node2 );
+            BOOST_CHECK_CLOSE( score1, score2, 0.0001 );
+        }
+    }
+}
+
+
+// Test reading an ARPA model and scoring with backoffs
+BOOST_AUTO_TEST_CASE(ReadArpa)
+{
+    cerr << endl;
+    Ngram lm;
+    lm.read_arpa("test/trigram.arpa");
+
+    BOOST_CHECK_EQUAL( 3, lm.order() );
+    BOOST_CHECK_EQUAL( 6, (int)lm.vocabulary.size() );
+    BOOST_CHECK_EQUAL( 19, (int)lm.nodes.size() );
+
+    BOOST_CHECK_CLOSE( -0.4-0.2-0.35, sentence_score(lm, "a b </s>"), 0.0001 );
+    // <s> b a: bigram <s> b, bigram b a (no trigram <s> b a)
+    BOOST_CHECK_CLOSE( -0.7-0.6, sentence_score(lm, "b a"), 0.0001 );
+    // a c: backoff from <s> a to a, then c </s>
+    BOOST_CHECK_CLOSE( -0.4-0.15-0.9-0.45, sentence_score(lm, "a c </s>"), 0.0001 );
+}
+
+
+// Test that the binary format gives identical scores
+BOOST_AUTO_TEST_CASE(BinaryFormat)
+{
+    cerr << endl;
+    string binfname("test/trigram.test.bin");
+
+    LNNgram lm;
+    lm.read_arpa("test/trigram.arpa");
+    lm.write_binary(binfname);
+    BOOST_CHECK( Ngram::is_binary(binfname) );
+    BOOST_CHECK( !Ngram::is_binary("test/trigram.arpa") );
+
+    LNNgram binlm;
+    binlm.read(binfname);
+    BOOST_CHECK( binlm.nodes.mapped() );
+    assert_same_scores(lm, binlm);
+
+    // The mapped model is not converted to another log base
+    Ngram log10lm;
+    BOOST_CHECK_THROW( log10lm.read(binfname), string );
+
+    remove(binfname.c_str());
+}
+
+
+// Test that a written ARPA file reads back to the same model
+BOOST_AUTO_TEST_CASE(WriteArpa)
+{
+    cerr << endl;
+    string arpafname("test/trigram.test.arpa.gz");
+
+    LNNgram lm;
+    lm.read_arpa("test/trigram.arpa");
+    lm.write_arpa(arpafname);
+
+    LNNgram arpalm;
+    arpalm.read_arpa(arpafname);
+    BOOST_CHECK_EQUAL( lm.order(), arpalm.order() );
+    BOOST_CHECK( lm.vocabulary == arpalm.vocabulary );
+    BOOST_CHECK_EQUAL( lm.nodes.size(), arpalm.nodes.size() );
+    for (int order=1; order<=lm.order(); order++)
+        BOOST_CHECK_EQUAL( lm.ngram_counts_per_order.at(order), arpalm.ngram_counts_per_order.at(order) );
+    assert_same_scores(lm, arpalm);
+    remove(arpafname.c_str());
+
+    // A failed write leaves the probabilities unchanged
+    LNNgram qlm;
+    qlm.read_arpa("test/trigram.arpa");
+    qlm.quantize(8);
+    double score = sentence_score(qlm, "a b </s>");
+    BOOST_CHECK_THROW( qlm.write_arpa(arpafname), string );
+    BOOST_CHECK_EQUAL( score, sentence_score(qlm, "a b </s>") );
+}
+
+
+// Test that the parallel n-gram sort matches a serial sort
+BOOST_AUTO_TEST_CASE(SortOrder)
+{
+    cerr << endl;
+    Ngram lm;
+    lm.read_threads = 4;
+
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> wuni(0, 1000);
+    Ngram::OrderNgrams order_ngrams(3);
+    for (int i=0; i<500000; i++) {
+        for (int j=0; j<3; j++)
+            order_ngrams.words.push_back(wuni(rng));
+        order_ngrams.probs.push_back(0.0);
+        order_ngrams.backoff_probs.push_back(0.0);
+    }
+
+    vector<int> sorted_indices;
+    lm.read_arpa_sort_order(order_ngrams, sorted_indices);
+    BOOST_CHECK_EQUAL( order_ngrams.size(), (int)sorted_indices.size() );
+
+    vector<vector<int> > ref_ngrams, sorted_ngrams;
+    for (int i=0; i<order_ngrams.size(); i++) {
+        const int *ngram = order_ngrams.ngram(i);
+        ref_ngrams.push_back(vector<int>(ngram, ngram+3));
+        ngram = order_ngrams.ngram(sorted_indices[i]);
+        sorted_ngrams.push_back(vector<int>(ngram, ngram+3));
+    }
+    sort(ref_ngrams.begin(), ref_ngrams.end());
+    BOOST_CHECK( ref_ngrams == sorted_ngrams );
+}
+
+
+// Test the quantized representation
+BOOST_AUTO_TEST_CASE(Quantize)
+{
+    cerr << endl;
+    LNNgram lm;
+    lm.read_arpa("test/trigram.arpa");
+
+    // All distinct values fit in the codebooks
+    LNNgram qlm;
+    qlm.read_arpa("test/trigram.arpa");
+    qlm.quantize(8);
+    BOOST_CHECK( qlm.quantized() );
+    BOOST_CHECK_EQUAL( 0, (int)qlm.nodes.size() );
+    assert_same_scores(lm, qlm);
+
+    // Coarse quantization keeps the structure
+    LNNgram q2lm;
+    q2lm.read_arpa("test/trigram.arpa");
+    q2lm.quantize(2);
+    for (int n=0; n<(int)lm.nodes.size(); n++) {
+        for (int w=0; w<(int)lm.vocabulary.size(); w++) {
+            double score1 = 0.0, score2 = 0.0;
+            BOOST_CHECK_EQUAL( lm.score(n, w, score1), q2lm.score(n, w, score2) );
+            BOOST_CHECK( fabs(score1-score2) < 1.5 );
+        }
+    }
+
+    // Quantized models are stored and mapped in the compact form,
+    // with one and two byte codes
+    string binfname("test/trigram.test.q.bin");
+    for (int bits=8; bits<=12; bits+=4) {
+        LNNgram q3lm;
+        q3lm.read_arpa("test/trigram.arpa");
+        q3lm.quantize(bits);
+        q3lm.write_binary(binfname);
+        LNNgram binlm;
+        binlm.read(binfname);
+        BOOST_CHECK( binlm.quantized() );
+        BOOST_CHECK( binlm.compact_nodes.mapped() );
+        assert_same_scores(lm, binlm);
+    }
+    remove(binfname.c_str());
+}
+
+
+// Test the hashed arc lookups
+BOOST_AUTO_TEST_CASE(HashLookup)
+{
+    cerr << endl;
+    LNNgram lm;
+    lm.read_arpa("test/trigram.arpa");
+
+    LNNgram hlm;
+    hlm.read_arpa("test/trigram.arpa");
+    hlm.use_hash_lookup();
+    BOOST_CHECK( hlm.hash_lookup() );
+    assert_same_scores(lm, hlm);
+
+    // Hash lookups combined with the quantized representation
+    hlm.quantize(16);
+    assert_same_scores(lm, hlm);
+    LNNgram qlm;
+    qlm.read_arpa("test/trigram.arpa");
+    qlm.quantize(16);
+    qlm.use_hash_lookup();
+    assert_same_scores(lm, qlm);
+
+    hlm.use_hash_lookup(false);
+    BOOST_CHECK( !hlm.hash_lookup() );
+    assert_same_scores(lm, hlm);
+}
+
+
+// Test that cached scores match the model
+BOOST_AUTO_TEST_CASE(ScoreCache)
+{
+    cerr << endl;
+    LNNgram lm;
+    lm.read_arpa("test/trigram.arpa");
+    NgramCache cache(lm, 4);
+    NgramCache passthrough(lm);
+
+    for (int round=0; round<2; round++) {
+        for (int n=0; n<(int)lm.nodes.size(); n++) {
+            for (int w=0; w<(int)lm.vocabulary.size(); w++) {
+                double score = 0.0, cached_score = 0.0, passthrough_score = 0.0;
+                int node = lm.score(n, w, score);
+                BOOST_CHECK_EQUAL( node, cache.score(n, w, cached_score) );
+                BOOST_CHECK_EQUAL( node, passthrough.score(n, w, passthrough_score) );
+                BOOST_CHECK_EQUAL( score, cached_score );
+                BOOST_CHECK_EQUAL( score, passthrough_score );
+            }
+        }
+    }
+    BOOST_CHECK_EQUAL( 2*(long int)(lm.nodes.size()*lm.vocabulary.size()), cache.hits+cache.misses );
+    BOOST_CHECK_EQUAL( 0, passthrough.hits+passthrough.misses );
+
+    double score = 0.0;
+    cache.clear();
+    cache.score(lm.sentence_start_node, 3, score);
+    cache.score(lm.sentence_start_node, 3, score);
+    BOOST_CHECK_EQUAL( 1, cache.hits );
+    BOOST_CHECK_EQUAL( 1, cache.misses );
+}
+
+
+// Test that batch scoring matches scoring one n-gram at a time
+BOOST_AUTO_TEST_CASE(ScoreBatch)
+{
+    cerr << endl;
+    LNNgram lm;
+    lm.read_arpa("test/trigram.arpa");
+
+    vector<int> nodes, words;
+    for (int n=0; n<(int)lm.nodes.size(); n++) {
+        for (int w=0; w<(int)lm.vocabulary.size(); w++) {
+            nodes.push_back(n);
+            words.push_back(w);
+        }
+    }
+    vector<int> batch_nodes(nodes);
+    vector<double> batch_scores(nodes.size(), 0.0);
+    lm.score_batch(batch_nodes.data(), words.data(), batch_scores.data(), nodes.size());
+
+    for (int i=0; i<(int)nodes.size(); i++) {
+        double score = 0.0;
+        int node = lm.score(nodes[i], words[i], score);
+        BOOST_CHECK_EQUAL( node, batch_nodes[i] );
+        BOOST_CHECK_EQUAL( score, batch_scores[i] );
+    }
+}
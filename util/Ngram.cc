@@ -1,17 +1,29 @@
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <stdint.h>
 
 #include "Ngram.hh"
 #include "str.hh"
 
 using namespace std;
 
+#if defined(__GNUC__)
+#define NGRAM_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define NGRAM_PREFETCH(addr)
+#endif
+
 
 int
 Ngram::score(int node_idx, int word, double &score) const
 {
+    if (quantized()) return score_quantized(node_idx, word, score);
+
     while (true) {
         int tmp = find_node(node_idx, word);
         if (tmp != -1) {
@@ -35,6 +47,8 @@ Ngram::score(int node_idx, int word, double &score) const
 int
 Ngram::score(int node_idx, int word, float &score) const
 {
+    if (quantized()) return score_quantized(node_idx, word, score);
+
     while (true) {
         int tmp = find_node(node_idx, word);
         if (tmp != -1) {
@@ -55,10 +69,126 @@ Ngram::score(int node_idx, int word, float &score) const
 }
 
 
+// Advances many independent states by one word each. Each state is a
+// small state machine and one binary search step is taken for each
+// active state in turn, prefetching the memory the next step of that
+// state needs, so that the cache misses of the states overlap.
+void
+Ngram::score_batch(int *node_idxs, const int *words, double *scores, int num_states) const
+{
+    if (quantized() || hash_lookup()) {
+        for (int i=0; i<num_states; i++)
+            node_idxs[i] = score(node_idxs[i], words[i], scores[i]);
+        return;
+    }
+
+    enum Stage { NODE, SEARCH, TARGET };
+    class Lane {
+    public:
+        int state;
+        Stage stage;
+        int node;
+        int first;
+        int last;
+        int end;
+    };
+
+    vector<Lane> lanes(num_states);
+    for (int i=0; i<num_states; i++) {
+        lanes[i].state = i;
+        lanes[i].stage = NODE;
+        lanes[i].node = node_idxs[i];
+        NGRAM_PREFETCH(&nodes[node_idxs[i]]);
+    }
+
+    int num_active = num_states;
+    while (num_active > 0) {
+        for (int l=0; l<num_active; l++) {
+            Lane &lane = lanes[l];
+            int word = words[lane.state];
+            bool done = false;
+
+            if (lane.stage == NODE) {
+                const Node &nd = nodes[lane.node];
+                if (nd.first_arc == -1) {
+                    scores[lane.state] += nd.backoff_prob;
+                    lane.node = nd.backoff_node;
+                    NGRAM_PREFETCH(&nodes[lane.node]);
+                    continue;
+                }
+                lane.first = nd.first_arc;
+                lane.last = nd.last_arc+1;
+                lane.end = lane.last;
+                lane.stage = SEARCH;
+                NGRAM_PREFETCH(&arc_words[lane.first + (lane.last-lane.first)/2]);
+            }
+            else if (lane.stage == SEARCH) {
+                if (lane.first < lane.last) {
+                    int middle = lane.first + (lane.last-lane.first)/2;
+                    if (arc_words[middle] < word) lane.first = middle+1;
+                    else lane.last = middle;
+                    if (lane.first < lane.last)
+                        NGRAM_PREFETCH(&arc_words[lane.first + (lane.last-lane.first)/2]);
+                    continue;
+                }
+                if (lane.first != lane.end && arc_words[lane.first] == word) {
+                    lane.node = arc_target_nodes[lane.first];
+                    lane.stage = TARGET;
+                    NGRAM_PREFETCH(&nodes[lane.node]);
+                }
+                else {
+                    const Node &nd = nodes[lane.node];
+                    scores[lane.state] += nd.backoff_prob;
+                    lane.node = nd.backoff_node;
+                    lane.stage = NODE;
+                    NGRAM_PREFETCH(&nodes[lane.node]);
+                }
+            }
+            else {
+                const Node &nd = nodes[lane.node];
+                scores[lane.state] += nd.prob;
+                node_idxs[lane.state] = (nd.first_arc == -1) ? nd.backoff_node : lane.node;
+                done = true;
+            }
+
+            if (done) {
+                lanes[l] = lanes[num_active-1];
+                num_active--;
+                l--;
+            }
+        }
+    }
+}
+
+
+template <typename T>
+int
+Ngram::score_quantized(int node_idx, int word, T &score) const
+{
+    while (true) {
+        int tmp = find_node(node_idx, word);
+        if (tmp != -1) {
+            score += quantized_prob(tmp);
+            if (compact_nodes[tmp].child_start == compact_nodes[tmp+1].child_start)
+                return compact_nodes[tmp].backoff_node;
+            else
+                return tmp;
+        }
+        else {
+            score += quantized_backoff_prob(node_idx);
+            node_idx = compact_nodes[node_idx].backoff_node;
+        }
+    }
+
+    throw string("Problem in assigning an n-gram score.");
+}
+
+
 void
 Ngram::get_reverse_bigrams(map<int, vector<int> > &reverse_bigrams)
 {
     if (order() != 2) throw string("Error, not a bigram model.");
+    if (quantized()) throw string("Error, not supported for quantized models.");
 
     Node &root_nd = nodes[root_node];
     for (int i=root_nd.first_arc; i<=root_nd.last_arc; i++) {
@@ -76,6 +206,9 @@ Ngram::get_reverse_bigrams(map<int, vector<int> > &reverse_bigrams)
 int
 Ngram::find_node(int node_idx, int word) const
 {
+    if (hash_lookup()) return find_hashed_node(node_idx, word);
+    if (quantized()) return find_compact_node(node_idx, word);
+
     int first_arc = nodes[node_idx].first_arc;
     if (first_arc == -1) return -1;
     int last_arc = nodes[node_idx].last_arc+1;
@@ -87,6 +220,75 @@ Ngram::find_node(int node_idx, int word) const
 }
 
 
+int
+Ngram::find_compact_node(int node_idx, int word) const
+{
+    int first = compact_nodes[node_idx].child_start;
+    int last = compact_nodes[node_idx+1].child_start;
+    while (first < last) {
+        int middle = first + (last-first)/2;
+        if (compact_nodes[middle].word < word) first = middle+1;
+        else last = middle;
+    }
+    if (first == compact_nodes[node_idx+1].child_start
+        || compact_nodes[first].word != word) return -1;
+    return first;
+}
+
+
+void
+Ngram::use_hash_lookup(bool hash_lookup)
+{
+    vector<int>().swap(unigram_nodes);
+    vector<HashedArc>().swap(arc_hash);
+    arc_hash_mask = 0;
+    if (!hash_lookup) return;
+
+    // Children of each node either from the arcs or from the compact nodes
+    int num_nodes = quantized() ? compact_nodes.size()-1 : nodes.size();
+    vector<pair<int, int> > child_ranges(num_nodes);
+    long long int num_arcs = 0;
+    for (int i=0; i<num_nodes; i++) {
+        if (quantized())
+            child_ranges[i] = make_pair(compact_nodes[i].child_start, compact_nodes[i+1].child_start);
+        else if (nodes[i].first_arc != -1)
+            child_ranges[i] = make_pair(nodes[i].first_arc, nodes[i].last_arc+1);
+        else
+            child_ranges[i] = make_pair(0, 0);
+        if (i != root_node) num_arcs += child_ranges[i].second-child_ranges[i].first;
+    }
+
+    unsigned long long capacity = 1;
+    while (capacity < (unsigned long long)(num_arcs*4/3+1)) capacity <<= 1;
+    HashedArc empty;
+    empty.node = -1;
+    empty.word = -1;
+    empty.target_node = -1;
+    arc_hash.assign(capacity, empty);
+    arc_hash_mask = capacity-1;
+
+    unigram_nodes.assign(vocabulary.size(), -1);
+    for (int i=0; i<num_nodes; i++) {
+        for (int c=child_ranges[i].first; c<child_ranges[i].second; c++) {
+            int word = quantized() ? compact_nodes[c].word : arc_words[c];
+            int target_node = quantized() ? c : arc_target_nodes[c];
+            if (i == root_node) {
+                unigram_nodes[word] = target_node;
+                continue;
+            }
+            unsigned long long hash_idx = arc_hash_index(i, word);
+            while (arc_hash[hash_idx].node != -1)
+                hash_idx = (hash_idx+1) & arc_hash_mask;
+            arc_hash[hash_idx].node = i;
+            arc_hash[hash_idx].word = word;
+            arc_hash[hash_idx].target_node = target_node;
+        }
+    }
+
+    cerr << "Hashed " << num_arcs << " arcs in a table of " << capacity << " entries" << endl;
+}
+
+
 void _getline(SimpleFileInput &sfi, string &line, int &linei) {
     const string read_error("Problem reading ARPA file");
     if (!sfi.getline(line)) throw read_error;
@@ -98,6 +300,8 @@ void _getline(SimpleFileInput &sfi, string &line, int &linei) {
 void
 Ngram::write_arpa(string arpafname) {
 
+    if (quantized()) throw string("Error, not supported for quantized models.");
+
     SimpleFileOutput arpafile(arpafname);
 
     arpafile << "\n";
@@ -105,34 +309,42 @@ Ngram::write_arpa(string arpafname) {
     for (int order=1; order<=max_order; order++)
         arpafile << "ngram " << order << "=" << ngram_counts_per_order.at(order) << "\n";
 
-    vector<pair<int, vector<string> > > order_nodes, next_order_nodes;
-    order_nodes.push_back(make_pair(root_node, vector<string>()));
-
+    // Each order is written in a depth-first pass over the tree, which
+    // gives the same n-gram order as expanding the previous order
+    vector<int> node_stack, arc_stack, word_stack;
     for (int order=1; order<=max_order; order++) {
         arpafile << "\n";
         arpafile << "\\" << order << "-grams:\n";
-        for (auto cnit = order_nodes.begin(); cnit != order_nodes.end(); ++cnit) {
-            int curr_node = cnit->first;
-            vector<string> &ctxt = cnit->second;
-            Node &nd = nodes[curr_node];
-            if (nd.first_arc == -1) continue;
-            for (int a=nd.first_arc; a<=nd.last_arc; a++) {
-                int target_node_idx = arc_target_nodes[a];
-                Node &target_nd = nodes[target_node_idx];
-                string word = vocabulary[arc_words[a]];
-                arpafile << target_nd.prob << "\t";
-                for (auto ctxtit = ctxt.begin(); ctxtit != ctxt.end(); ++ctxtit)
-                    arpafile << *ctxtit << " ";
-                arpafile << word;
-                if (target_nd.backoff_prob != 0.0) arpafile << "\t" << target_nd.backoff_prob;
-                arpafile << "\n";
-                vector<string> new_ctxt(ctxt);
-                new_ctxt.push_back(word);
-                next_order_nodes.push_back(make_pair(target_node_idx, new_ctxt));
+        node_stack.assign(1, root_node);
+        arc_stack.assign(1, nodes[root_node].first_arc);
+        word_stack.clear();
+        while (node_stack.size() > 0) {
+            const Node &nd = nodes[node_stack.back()];
+            int a = arc_stack.back();
+            if (nd.first_arc == -1 || a > nd.last_arc) {
+                node_stack.pop_back();
+                arc_stack.pop_back();
+                if (word_stack.size() > 0) word_stack.pop_back();
+                continue;
+            }
+            arc_stack.back()++;
+
+            int target_node_idx = arc_target_nodes[a];
+            if ((int)node_stack.size() < order) {
+                node_stack.push_back(target_node_idx);
+                arc_stack.push_back(nodes[target_node_idx].first_arc);
+                word_stack.push_back(arc_words[a]);
+                continue;
             }
+
+            const Node &target_nd = nodes[target_node_idx];
+            arpafile << target_nd.prob << "\t";
+            for (auto wit = word_stack.begin(); wit != word_stack.end(); ++wit)
+                arpafile << vocabulary[*wit] << " ";
+            arpafile << vocabulary[arc_words[a]];
+            if (target_nd.backoff_prob != 0.0) arpafile << "\t" << target_nd.backoff_prob;
+            arpafile << "\n";
         }
-        order_nodes.swap(next_order_nodes);
-        next_order_nodes.clear();
     }
 
     arpafile << "\n\\end\\\n";
@@ -180,6 +392,7 @@ Ngram::read_arpa(string arpafname) {
     arc_target_nodes.resize(total_ngram_count);
     int curr_node_idx = 1;
     int curr_arc_idx = 0;
+    unordered_map<string, int> word_lookup;
 
     while (curr_ngram_order <= max_ngram_order) {
 
@@ -191,22 +404,31 @@ Ngram::read_arpa(string arpafname) {
         }
 
         _getline(arpafile, line, linei);
-        vector<NgramInfo> order_ngrams;
-        int ngrams_read = read_arpa_read_order(arpafile, order_ngrams, line, curr_ngram_order, linei);
+        OrderNgrams order_ngrams(curr_ngram_order);
+        order_ngrams.reserve(ngram_counts_per_order[curr_ngram_order]);
+        int ngrams_read = read_arpa_read_order(arpafile, order_ngrams, word_lookup, line, linei);
 
         cerr << "n-grams for order " << curr_ngram_order << ": " << ngrams_read << endl;
         if (ngrams_read != ngram_counts_per_order[curr_ngram_order])
-            throw string("Invalid number of n-grams for order: " + curr_ngram_order);
+            throw string("Invalid number of n-grams for order: " + str::str(curr_ngram_order));
 
-        sort(order_ngrams.begin(), order_ngrams.end());
+        vector<int> sorted_indices;
+        read_arpa_sort_order(order_ngrams, sorted_indices);
 
-        read_arpa_insert_order_to_tree(order_ngrams, curr_node_idx, curr_arc_idx, curr_ngram_order);
+        read_arpa_insert_order_to_tree(order_ngrams, sorted_indices, curr_node_idx, curr_arc_idx);
 
         max_order = curr_ngram_order;
         curr_ngram_order++;
         total_ngrams_read += ngrams_read;
     }
 
+    set_symbols();
+}
+
+
+void
+Ngram::set_symbols()
+{
     if (vocabulary_lookup.find(sentence_start_symbol) == vocabulary_lookup.end())
         throw string("Sentence start symbol not found.");
     sentence_start_symbol_idx = vocabulary_lookup[sentence_start_symbol];
@@ -234,46 +456,77 @@ Ngram::read_arpa(string arpafname) {
 }
 
 
+// Advance over spaces and tabs
+inline const char*
+skip_blanks(const char *ptr)
+{
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+    return ptr;
+}
+
+
+// Advance to the next space, tab or end of string
+inline const char*
+skip_token(const char *ptr)
+{
+    while (*ptr != '\0' && *ptr != ' ' && *ptr != '\t') ptr++;
+    return ptr;
+}
+
+
 int
 Ngram::read_arpa_read_order(SimpleFileInput &arpafile,
-                            vector<NgramInfo> &order_ngrams,
+                            OrderNgrams &order_ngrams,
+                            unordered_map<string, int> &word_lookup,
                             string &line,
-                            int curr_ngram_order,
                             int &linei)
 {
     int ngrams_read = 0;
+    int curr_ngram_order = order_ngrams.order;
+    string word;
 
     while (line.length() > 0) {
-        stringstream vals(line);
+        const char *ptr = line.c_str();
+        char *endptr;
 
-        NgramInfo ngram;
-        vals >> ngram.prob;
-        if (ngram.prob > 0.0) {
-            throw string("Invalid log probability " + line);
-        }
+        double prob = strtod(ptr, &endptr);
+        if (endptr == ptr) throw string("Problem reading line: " + line);
+        if (prob > 0.0) throw string("Invalid log probability " + line);
+        ptr = endptr;
 
-        vector<string> curr_ngram_str;
-        string tmp;
         for (int i=0; i<curr_ngram_order; i++) {
-            if (vals.eof()) throw string("Problem reading line: " + line);
-            vals >> tmp;
-            curr_ngram_str.push_back(tmp);
-        }
-        if (curr_ngram_order == 1) {
-            vocabulary.push_back(curr_ngram_str[0]);
-            vocabulary_lookup[curr_ngram_str[0]] = vocabulary.size()-1;
-        }
+            ptr = skip_blanks(ptr);
+            const char *token_end = skip_token(ptr);
+            if (token_end == ptr) throw string("Problem reading line: " + line);
+            word.assign(ptr, token_end-ptr);
+            ptr = token_end;
 
-        vector<int> curr_ngram_words;
-        for (auto sit = curr_ngram_str.begin(); sit != curr_ngram_str.end(); ++sit)
-            curr_ngram_words.push_back(vocabulary_lookup[*sit]);
-        ngram.ngram = curr_ngram_words;
+            if (curr_ngram_order == 1) {
+                if (word_lookup.find(word) != word_lookup.end())
+                    throw string("Duplicate n-gram in model");
+                vocabulary.push_back(word);
+                vocabulary_lookup[word] = vocabulary.size()-1;
+                word_lookup[word] = vocabulary.size()-1;
+                order_ngrams.words.push_back(vocabulary.size()-1);
+            }
+            else {
+                auto wit = word_lookup.find(word);
+                if (wit == word_lookup.end())
+                    throw string("Unknown word in n-gram: " + line);
+                order_ngrams.words.push_back(wit->second);
+            }
+        }
 
-        if (!vals.eof())
-            vals >> ngram.backoff_prob;
-        if (vals.fail()) throw string("Problem reading line: " + line);
+        double backoff_prob = 0.0;
+        ptr = skip_blanks(ptr);
+        if (*ptr != '\0') {
+            backoff_prob = strtod(ptr, &endptr);
+            if (endptr == ptr) throw string("Problem reading line: " + line);
+            if (*skip_blanks(endptr) != '\0') throw string("Problem reading line: " + line);
+        }
 
-        order_ngrams.push_back(ngram);
+        order_ngrams.probs.push_back(prob);
+        order_ngrams.backoff_probs.push_back(backoff_prob);
         _getline(arpafile, line, linei);
         ngrams_read++;
     }
@@ -282,42 +535,121 @@ Ngram::read_arpa_read_order(SimpleFileInput &arpafile,
 }
 
 
+class NgramIndexComparator {
+public:
+    NgramIndexComparator(const Ngram::OrderNgrams &order_ngrams)
+        : m_order_ngrams(order_ngrams) { }
+    bool operator()(int a, int b) const {
+        const int *ngram_a = m_order_ngrams.ngram(a);
+        const int *ngram_b = m_order_ngrams.ngram(b);
+        return lexicographical_compare(ngram_a, ngram_a+m_order_ngrams.order,
+                                       ngram_b, ngram_b+m_order_ngrams.order);
+    }
+private:
+    const Ngram::OrderNgrams &m_order_ngrams;
+};
+
+
+void
+Ngram::read_arpa_sort_order(const OrderNgrams &order_ngrams,
+                            vector<int> &sorted_indices) const
+{
+    int num_ngrams = order_ngrams.size();
+    sorted_indices.resize(num_ngrams);
+    for (int i=0; i<num_ngrams; i++)
+        sorted_indices[i] = i;
+
+    NgramIndexComparator comparator(order_ngrams);
+    if (is_sorted(sorted_indices.begin(), sorted_indices.end(), comparator))
+        return;
+
+    int num_threads = max(1, min(read_threads, num_ngrams/100000));
+    if (num_threads == 1) {
+        sort(sorted_indices.begin(), sorted_indices.end(), comparator);
+        return;
+    }
+
+    // Sort chunks in parallel and merge pairwise, also the merges of
+    // each round in parallel
+    vector<int> bounds;
+    for (int t=0; t<=num_threads; t++)
+        bounds.push_back((long int)num_ngrams*t/num_threads);
+
+    vector<std::thread> workers;
+    for (int t=0; t<num_threads; t++)
+        workers.push_back(std::thread([&, t]() {
+            sort(sorted_indices.begin()+bounds[t], sorted_indices.begin()+bounds[t+1], comparator);
+        }));
+    for (auto wit = workers.begin(); wit != workers.end(); ++wit)
+        wit->join();
+
+    while (bounds.size() > 2) {
+        vector<int> merged_bounds;
+        workers.clear();
+        for (int b=0; b+2<(int)bounds.size(); b+=2) {
+            int first = bounds[b], middle = bounds[b+1], last = bounds[b+2];
+            workers.push_back(std::thread([&, first, middle, last]() {
+                inplace_merge(sorted_indices.begin()+first,
+                              sorted_indices.begin()+middle,
+                              sorted_indices.begin()+last,
+                              comparator);
+            }));
+            merged_bounds.push_back(first);
+        }
+        if (bounds.size() % 2 == 0) merged_bounds.push_back(bounds[bounds.size()-2]);
+        merged_bounds.push_back(bounds.back());
+        for (auto wit = workers.begin(); wit != workers.end(); ++wit)
+            wit->join();
+        bounds.swap(merged_bounds);
+    }
+}
+
+
 void
-Ngram::read_arpa_insert_order_to_tree(std::vector<NgramInfo> &order_ngrams,
+Ngram::read_arpa_insert_order_to_tree(const OrderNgrams &order_ngrams,
+                                      const vector<int> &sorted_indices,
                                       int &curr_node_idx,
-                                      int &curr_arc_idx,
-                                      int curr_order)
+                                      int &curr_arc_idx)
 {
-    for (unsigned int ni=0; ni<order_ngrams.size(); ni++) {
+    int order = order_ngrams.order;
+    const int *prev_ngram = NULL;
+    int node_idx_traversal = root_node;
+
+    for (auto sit = sorted_indices.begin(); sit != sorted_indices.end(); ++sit) {
 
-        int node_idx_traversal = root_node;
-        for (unsigned int i=0; i<order_ngrams[ni].ngram.size()-1; i++) {
-            node_idx_traversal = find_node(node_idx_traversal, order_ngrams[ni].ngram[i]);
-            if (node_idx_traversal == -1) throw string("Missing lower order n-gram");
+        const int *ngram = order_ngrams.ngram(*sit);
+
+        // Sorted n-grams sharing the context are inserted under the same node
+        if (prev_ngram == NULL || !equal(ngram, ngram+order-1, prev_ngram)) {
+            node_idx_traversal = root_node;
+            for (int i=0; i<order-1; i++) {
+                node_idx_traversal = find_node(node_idx_traversal, ngram[i]);
+                if (node_idx_traversal == -1) throw string("Missing lower order n-gram");
+            }
         }
-        int tmp = find_node(node_idx_traversal, order_ngrams[ni].ngram.back());
-        if (tmp != -1)
+        else if (ngram[order-1] == prev_ngram[order-1])
             throw string("Duplicate n-gram in model");
+        prev_ngram = ngram;
 
         if (nodes[node_idx_traversal].first_arc == -1)
             nodes[node_idx_traversal].first_arc = curr_arc_idx;
         nodes[node_idx_traversal].last_arc = curr_arc_idx;
 
-        arc_words[curr_arc_idx] = order_ngrams[ni].ngram.back();
+        arc_words[curr_arc_idx] = ngram[order-1];
         arc_target_nodes[curr_arc_idx] = curr_node_idx;
-        nodes[curr_node_idx].prob = order_ngrams[ni].prob;
-        nodes[curr_node_idx].backoff_prob = order_ngrams[ni].backoff_prob;
+        nodes[curr_node_idx].prob = order_ngrams.probs[*sit];
+        nodes[curr_node_idx].backoff_prob = order_ngrams.backoff_probs[*sit];
 
         int ctxt_start = 1;
         while (true) {
             int bo_traversal = root_node;
-            unsigned int i = ctxt_start;
-            for (; i<order_ngrams[ni].ngram.size(); i++) {
-                int tmp = find_node(bo_traversal, order_ngrams[ni].ngram[i]);
+            int i = ctxt_start;
+            for (; i<order; i++) {
+                int tmp = find_node(bo_traversal, ngram[i]);
                 if (tmp == -1) break;
                 bo_traversal = tmp;
             }
-            if (i >= order_ngrams[ni].ngram.size()) {
+            if (i >= order) {
                 nodes[curr_node_idx].backoff_node = bo_traversal;
                 break;
             }
@@ -330,8 +662,215 @@ Ngram::read_arpa_insert_order_to_tree(std::vector<NgramInfo> &order_ngrams,
 }
 
 
+#define NGRAM_BINARY_MAGIC "NGRAMBIN"
+#define NGRAM_BINARY_VERSION 1
+
+struct NgramBinaryHeader {
+    char magic[8];
+    int32_t version;
+    int32_t node_size;
+    int32_t natural_log_probs;
+    int32_t max_order;
+    int32_t root_node;
+    int32_t quantization_bits;
+    int64_t num_nodes;
+    int64_t num_arcs;
+    int64_t vocabulary_size;
+    int64_t vocabulary_bytes;
+};
+
+
+// Sections in the binary file are aligned to 8 bytes
+inline size_t
+binary_padding(size_t offset)
+{
+    return (8 - offset % 8) % 8;
+}
+
+
+inline void
+write_binary_section(FILE *fp, const void *data, size_t bytes, size_t &offset)
+{
+    if (bytes > 0 && fwrite(data, 1, bytes, fp) != bytes)
+        throw string("Problem writing binary n-gram model");
+    offset += bytes;
+    static const char zeros[8] = { 0 };
+    size_t padding = binary_padding(offset);
+    if (padding > 0 && fwrite(zeros, 1, padding, fp) != padding)
+        throw string("Problem writing binary n-gram model");
+    offset += padding;
+}
+
+
+bool
+Ngram::is_binary(string fname)
+{
+    FILE *fp = fopen(fname.c_str(), "rb");
+    if (fp == NULL) return false;
+    char magic[8];
+    bool binary = (fread(magic, 1, 8, fp) == 8
+                   && memcmp(magic, NGRAM_BINARY_MAGIC, 8) == 0);
+    fclose(fp);
+    return binary;
+}
+
+
+void
+Ngram::read(string fname)
+{
+    if (is_binary(fname)) read_binary(fname);
+    else read_arpa(fname);
+}
+
+
+void
+Ngram::write_binary(string binfname) const
+{
+    string vocabulary_data;
+    for (auto vit = vocabulary.begin(); vit != vocabulary.end(); ++vit) {
+        vocabulary_data += *vit;
+        vocabulary_data += '\0';
+    }
+
+    NgramBinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, NGRAM_BINARY_MAGIC, 8);
+    header.version = NGRAM_BINARY_VERSION;
+    header.node_size = quantized() ? sizeof(CompactNode) : sizeof(Node);
+    header.natural_log_probs = natural_log_probs();
+    header.max_order = max_order;
+    header.root_node = root_node;
+    header.quantization_bits = quantized() ? quantization_bits : 0;
+    header.num_nodes = quantized() ? compact_nodes.size()-1 : nodes.size();
+    header.num_arcs = quantized() ? 0 : arc_words.size();
+    header.vocabulary_size = vocabulary.size();
+    header.vocabulary_bytes = vocabulary_data.size();
+
+    vector<int64_t> counts;
+    for (int order=1; order<=max_order; order++)
+        counts.push_back(ngram_counts_per_order.at(order));
+
+    FILE *fp = fopen(binfname.c_str(), "wb");
+    if (fp == NULL) throw string("Could not open file for writing: " + binfname);
+    size_t offset = 0;
+    try {
+        write_binary_section(fp, &header, sizeof(header), offset);
+        write_binary_section(fp, counts.data(), counts.size()*sizeof(int64_t), offset);
+        if (quantized()) {
+            write_binary_section(fp, order_starts.data(), order_starts.size()*sizeof(int), offset);
+            write_binary_section(fp, prob_codebook.data(), prob_codebook.size()*sizeof(float), offset);
+            write_binary_section(fp, backoff_codebook.data(), backoff_codebook.size()*sizeof(float), offset);
+            write_binary_section(fp, compact_nodes.begin(), compact_nodes.size()*sizeof(CompactNode), offset);
+            write_binary_section(fp, node_codes.begin(), node_codes.size(), offset);
+        }
+        else {
+            write_binary_section(fp, nodes.begin(), nodes.size()*sizeof(Node), offset);
+            write_binary_section(fp, arc_words.begin(), arc_words.size()*sizeof(int), offset);
+            write_binary_section(fp, arc_target_nodes.begin(), arc_target_nodes.size()*sizeof(int), offset);
+        }
+        write_binary_section(fp, vocabulary_data.data(), vocabulary_data.size(), offset);
+    } catch (...) {
+        fclose(fp);
+        throw;
+    }
+    if (fclose(fp) != 0) throw string("Problem writing binary n-gram model");
+}
+
+
+void
+Ngram::read_binary(string binfname)
+{
+    const string format_error("Invalid binary n-gram model: " + binfname);
+
+    mapped_file.reset(new MemoryMappedFile(binfname));
+    char *data = mapped_file->data();
+    size_t size = mapped_file->size();
+    size_t offset = 0;
+    // Returns the next section after checking that it is in the file
+    auto section = [&](size_t bytes) {
+        if (bytes > size || offset > size-bytes) throw format_error;
+        char *ptr = data + offset;
+        offset += bytes + binary_padding(bytes);
+        return ptr;
+    };
+
+    NgramBinaryHeader header;
+    memcpy(&header, section(sizeof(header)), sizeof(header));
+    int bits = header.quantization_bits;
+    if (memcmp(header.magic, NGRAM_BINARY_MAGIC, 8) != 0
+        || header.version != NGRAM_BINARY_VERSION
+        || bits < 0 || bits > 16
+        || header.node_size != (int)(bits > 0 ? sizeof(CompactNode) : sizeof(Node))
+        || header.max_order < 1 || (bits > 0 && header.max_order > 255)
+        || header.num_nodes < 1 || header.num_nodes > INT32_MAX
+        || header.num_arcs < 0 || header.num_arcs > INT32_MAX
+        || header.vocabulary_bytes < 0)
+        throw format_error;
+    // The mapped probabilities are read-only and can not be converted
+    if ((bool)header.natural_log_probs != natural_log_probs())
+        throw string("Binary n-gram model " + binfname + " has another log base, write it with arpa2bin "
+                     + (natural_log_probs() ? "without" : "with") + " --log10");
+
+    max_order = header.max_order;
+    root_node = header.root_node;
+    ngram_counts_per_order.clear();
+    const int64_t *counts = reinterpret_cast<const int64_t*>(section(max_order*sizeof(int64_t)));
+    for (int order=1; order<=max_order; order++)
+        ngram_counts_per_order[order] = counts[order-1];
+
+    nodes.clear();
+    arc_words.clear();
+    arc_target_nodes.clear();
+    compact_nodes.clear();
+    node_codes.clear();
+    quantization_bits = bits;
+    if (bits > 0) {
+        size_t num_codes = (size_t)(max_order+1) << bits;
+        const int *starts = reinterpret_cast<const int*>(section((max_order+2)*sizeof(int)));
+        order_starts.assign(starts, starts+max_order+2);
+        const float *codebook = reinterpret_cast<const float*>(section(num_codes*sizeof(float)));
+        prob_codebook.assign(codebook, codebook+num_codes);
+        codebook = reinterpret_cast<const float*>(section(num_codes*sizeof(float)));
+        backoff_codebook.assign(codebook, codebook+num_codes);
+        compact_nodes.map(reinterpret_cast<CompactNode*>(section((header.num_nodes+1)*sizeof(CompactNode))),
+                          header.num_nodes+1);
+        node_codes.map(reinterpret_cast<unsigned char*>(section(header.num_nodes*code_stride())),
+                       header.num_nodes*code_stride());
+        if (order_starts.back() != header.num_nodes) throw format_error;
+    }
+    else {
+        nodes.map(reinterpret_cast<Node*>(section(header.num_nodes*sizeof(Node))), header.num_nodes);
+        arc_words.map(reinterpret_cast<int*>(section(header.num_arcs*sizeof(int))), header.num_arcs);
+        arc_target_nodes.map(reinterpret_cast<int*>(section(header.num_arcs*sizeof(int))), header.num_arcs);
+    }
+
+    vocabulary.clear();
+    vocabulary_lookup.clear();
+    vocabulary.reserve(header.vocabulary_size);
+    const char *vocab_data = section(header.vocabulary_bytes);
+    const char *vocab_end = vocab_data + header.vocabulary_bytes;
+    while (vocab_data < vocab_end) {
+        size_t len = strnlen(vocab_data, vocab_end-vocab_data);
+        vocabulary.push_back(string(vocab_data, len));
+        vocabulary_lookup[vocabulary.back()] = vocabulary.size()-1;
+        vocab_data += len+1;
+    }
+    if ((int64_t)vocabulary.size() != header.vocabulary_size) throw format_error;
+
+    cerr << "Mapped binary n-gram model with " << header.num_nodes-1 << " n-grams";
+    if (bits > 0) cerr << " quantized to " << bits << " bits";
+    cerr << endl;
+    set_symbols();
+}
+
+
 void
-LNNgram::multiply_probs(double multiplier) {
+Ngram::multiply_probs(double multiplier) {
+    if (nodes.mapped()) throw string("Probabilities of a memory mapped n-gram model can not be modified");
+    for (auto cit = prob_codebook.begin(); cit != prob_codebook.end(); ++cit)
+        *cit *= multiplier;
+    for (auto cit = backoff_codebook.begin(); cit != backoff_codebook.end(); ++cit)
+        *cit *= multiplier;
     for (unsigned int i=0; i<nodes.size(); i++) {
         nodes[i].prob *= multiplier;
         nodes[i].backoff_prob *= multiplier;
@@ -339,6 +878,134 @@ LNNgram::multiply_probs(double multiplier) {
 }
 
 
+// Equal frequency binning, the codebook entries are the bin means
+// and in ascending order. Exact values are used if they fit.
+void
+build_codebook(vector<double> &values,
+               int num_codes,
+               vector<float> &codebook)
+{
+    sort(values.begin(), values.end());
+    codebook.clear();
+    vector<double> distinct;
+    for (auto vit = values.begin(); vit != values.end(); ++vit)
+        if (distinct.empty() || *vit != distinct.back()) {
+            distinct.push_back(*vit);
+            if ((int)distinct.size() > num_codes) break;
+        }
+    if ((int)distinct.size() <= num_codes) {
+        codebook.assign(distinct.begin(), distinct.end());
+        if (codebook.empty()) codebook.push_back(0.0);
+        return;
+    }
+
+    size_t start = 0;
+    for (int c=0; c<num_codes && start < values.size(); c++) {
+        size_t end = values.size()*(c+1)/num_codes;
+        if (end <= start) continue;
+        // Keep equal values in the same bin
+        while (end < values.size() && values[end] == values[end-1]) end++;
+        double sum = 0.0;
+        for (size_t i=start; i<end; i++) sum += values[i];
+        codebook.push_back(sum/(end-start));
+        start = end;
+    }
+}
+
+
+unsigned short
+encode_value(const vector<float> &codebook, double value)
+{
+    auto it = lower_bound(codebook.begin(), codebook.end(), value);
+    if (it == codebook.end()) return codebook.size()-1;
+    if (it != codebook.begin() && value-*(it-1) < *it-value) --it;
+    return it-codebook.begin();
+}
+
+
+void
+Ngram::quantize(int bits)
+{
+    if (quantized()) return;
+    if (bits < 1 || bits > 16) throw string("Invalid number of quantization bits.");
+    if (max_order > 255) throw string("Too many orders for quantization.");
+    int num_codes = 1 << bits;
+    int num_nodes = nodes.size();
+
+    // Nodes are inserted order by order and the children of a node
+    // follow the children of the previous node, so the child ranges
+    // are implicit in the start of each range
+    const string layout_error("Unsupported n-gram layout for quantization.");
+    order_starts.assign(1, root_node);
+    order_starts.push_back(root_node+1);
+    for (int order=1; order<=max_order; order++)
+        order_starts.push_back(order_starts.back() + ngram_counts_per_order.at(order));
+    if (root_node != 0 || order_starts.back() != num_nodes) throw layout_error;
+    int next_child_start = num_nodes;
+    for (int i=num_nodes-1; i>=0; i--) {
+        const Node &nd = nodes[i];
+        if (nd.first_arc == -1) continue;
+        for (int a=nd.first_arc; a<=nd.last_arc; a++)
+            if (arc_target_nodes[a] != a+1) throw layout_error;
+        if (nd.last_arc+2 != next_child_start) throw layout_error;
+        next_child_start = nd.first_arc+1;
+    }
+
+    // The last node only ends the children of the previous node
+    compact_nodes.resize(num_nodes+1);
+    compact_nodes[num_nodes].word = -1;
+    compact_nodes[num_nodes].child_start = num_nodes;
+    compact_nodes[num_nodes].backoff_node = -1;
+    next_child_start = num_nodes;
+    for (int i=num_nodes-1; i>=0; i--) {
+        const Node &nd = nodes[i];
+        if (nd.first_arc != -1) next_child_start = nd.first_arc+1;
+        compact_nodes[i].child_start = next_child_start;
+        compact_nodes[i].word = (i > 0) ? arc_words[i-1] : -1;
+        compact_nodes[i].backoff_node = nd.backoff_node;
+    }
+
+    quantization_bits = bits;
+    int stride = code_stride();
+    node_codes.resize((size_t)num_nodes*stride);
+    prob_codebook.assign((size_t)(max_order+1)*num_codes, 0.0f);
+    backoff_codebook.assign((size_t)(max_order+1)*num_codes, 0.0f);
+    vector<float> codebook, backoff_codebook_order;
+    for (int order=0; order<=max_order; order++) {
+        vector<double> probs, backoff_probs;
+        for (int i=order_starts[order]; i<order_starts[order+1]; i++) {
+            probs.push_back(nodes[i].prob);
+            backoff_probs.push_back(nodes[i].backoff_prob);
+        }
+        build_codebook(probs, num_codes, codebook);
+        build_codebook(backoff_probs, num_codes, backoff_codebook_order);
+        copy(codebook.begin(), codebook.end(), prob_codebook.begin() + order*num_codes);
+        copy(backoff_codebook_order.begin(), backoff_codebook_order.end(),
+             backoff_codebook.begin() + order*num_codes);
+        for (int i=order_starts[order]; i<order_starts[order+1]; i++) {
+            unsigned char *codes = &node_codes[(size_t)i*stride];
+            unsigned short prob_code = encode_value(codebook, nodes[i].prob);
+            unsigned short backoff_code = encode_value(backoff_codebook_order, nodes[i].backoff_prob);
+            codes[0] = order;
+            codes[1] = prob_code & 0xff;
+            codes[1+code_bytes()] = backoff_code & 0xff;
+            if (code_bytes() == 2) {
+                codes[2] = prob_code >> 8;
+                codes[4] = backoff_code >> 8;
+            }
+        }
+    }
+
+    nodes.clear();
+    arc_words.clear();
+    arc_target_nodes.clear();
+    mapped_file.reset();
+
+    cerr << "Quantized " << num_nodes-1 << " n-grams to " << bits << " bits, "
+         << sizeof(CompactNode)+stride << " bytes per n-gram" << endl;
+}
+
+
 void
 LNNgram::read_arpa(string arpafname) {
     Ngram::read_arpa(arpafname);
@@ -348,7 +1015,37 @@ LNNgram::read_arpa(string arpafname) {
 
 void
 LNNgram::write_arpa(string arpafname) {
+    if (quantized()) throw string("Error, not supported for quantized models.");
     multiply_probs(1.0/log(10.0));
-    Ngram::write_arpa(arpafname);
+    try {
+        Ngram::write_arpa(arpafname);
+    } catch (...) {
+        multiply_probs(log(10.0));
+        throw;
+    }
     multiply_probs(log(10.0));
 }
+
+
+NgramCache::NgramCache(const Ngram &lm, int size_bits)
+    : hits(0), misses(0), m_lm(&lm), m_mask(0)
+{
+    if (size_bits < 0 || size_bits > 30) throw string("Invalid n-gram cache size.");
+    if (size_bits > 0) {
+        m_entries.resize(1 << size_bits);
+        m_mask = (1 << size_bits)-1;
+    }
+    clear();
+}
+
+
+void
+NgramCache::clear()
+{
+    for (auto eit = m_entries.begin(); eit != m_entries.end(); ++eit) {
+        eit->node = -1;
+        eit->word = -1;
+    }
+    hits = 0;
+    misses = 0;
+}
@@ -1,12 +1,65 @@
 #ifndef NGRAM_HH
 #define NGRAM_HH
 
+#include <algorithm>
 #include <map>
+#include <memory>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "io.hh"
 
+
+/** Array which either owns its elements or refers to
+ *  a memory mapped region owned by someone else. */
+template <typename T>
+class NgramArray {
+public:
+    NgramArray() : m_data(NULL), m_size(0), m_mapped(false) { }
+    NgramArray(const NgramArray &other) { *this = other; }
+    NgramArray& operator=(const NgramArray &other) {
+        m_storage = other.m_storage;
+        m_mapped = other.m_mapped;
+        m_data = m_mapped ? other.m_data : m_storage.data();
+        m_size = other.m_size;
+        return *this;
+    }
+    void resize(size_t size) {
+        m_storage.resize(size);
+        m_data = m_storage.data();
+        m_size = size;
+        m_mapped = false;
+    }
+    void clear() {
+        std::vector<T>().swap(m_storage);
+        m_data = NULL;
+        m_size = 0;
+        m_mapped = false;
+    }
+    void map(T *data, size_t size) {
+        std::vector<T>().swap(m_storage);
+        m_data = data;
+        m_size = size;
+        m_mapped = true;
+    }
+    T& operator[](size_t i) { return m_data[i]; }
+    const T& operator[](size_t i) const { return m_data[i]; }
+    T* begin() { return m_data; }
+    T* end() { return m_data + m_size; }
+    const T* begin() const { return m_data; }
+    const T* end() const { return m_data + m_size; }
+    size_t size() const { return m_size; }
+    bool mapped() const { return m_mapped; }
+private:
+    std::vector<T> m_storage;
+    T *m_data;
+    size_t m_size;
+    bool m_mapped;
+};
+
+
 class Ngram {
 public:
 
@@ -21,6 +74,25 @@ public:
         int last_arc;
     };
 
+    /** Node of the quantized representation. The node stores the word
+     *  of its incoming arc and children are the nodes from child_start
+     *  up to the child_start of the next node. The order and the
+     *  probability codes of the node are stored in node_codes. */
+    class CompactNode {
+    public:
+        int word;
+        int child_start;
+        int backoff_node;
+    };
+
+    /** Entry of the open addressing hash table for arc lookups */
+    class HashedArc {
+    public:
+        int node;
+        int word;
+        int target_node;
+    };
+
     Ngram() : root_node(0),
         sentence_start_node(-1),
         sentence_start_symbol_idx(-1),
@@ -29,13 +101,27 @@ public:
         sentence_end_symbol("</s>"),
         unk_symbol_idx(-1),
         unk_symbol("<unk>"),
-        max_order(-1) { };
-    ~Ngram() {};
+        read_threads(std::max(1u, std::thread::hardware_concurrency())),
+        max_order(-1),
+        quantization_bits(0),
+        arc_hash_mask(0) { };
+    virtual ~Ngram() {};
+    void read(std::string fname);
     virtual void read_arpa(std::string arpafname);
     virtual void write_arpa(std::string arpafname);
+    void read_binary(std::string binfname);
+    void write_binary(std::string binfname) const;
+    static bool is_binary(std::string fname);
+    virtual bool natural_log_probs() const { return false; }
+    void multiply_probs(double multiplier);
+    void quantize(int bits);
+    bool quantized() const { return compact_nodes.size() > 0; }
+    void use_hash_lookup(bool hash_lookup=true);
+    bool hash_lookup() const { return arc_hash.size() > 0; }
     int score(int node_idx, int word, double &score) const;
     int score(int node_idx, int word, float &score) const;
     int advance(int node_idx, int word) const { float tmp; return score(node_idx, word, tmp); }
+    void score_batch(int *node_idxs, const int *words, double *scores, int num_states) const;
     int order() { return max_order; };
     void get_reverse_bigrams(std::map<int, std::vector<int> > &reverse_bigrams);
 
@@ -53,50 +139,159 @@ public:
     std::vector<std::string> vocabulary;
     std::map<std::string, int> vocabulary_lookup;
 
+    // Number of threads for sorting the n-grams when reading ARPA files
+    int read_threads;
+
 
 //private:
 
-    class NgramInfo {
+    /** N-grams of one order stored with a fixed stride of order words */
+    class OrderNgrams {
     public:
-        NgramInfo() : prob(0.0), backoff_prob(0.0) { }
-        std::vector<int> ngram;
-        double prob;
-        double backoff_prob;
-        bool operator<(const NgramInfo &ngri) const
-        {
-            if (ngram.size() != ngri.ngram.size())
-                throw std::string("Comparing ngrams of different order");
-            for (unsigned int i=0; i<ngram.size(); i++)
-                if (ngram[i] < ngri.ngram[i]) return true;
-                else if (ngri.ngram[i] < ngram[i]) return false;
-            std::cerr << "Warning, comparing same n-grams" << std::endl;
-            return false;
+        OrderNgrams(int order) : order(order) { }
+        void reserve(int count) {
+            words.reserve((size_t)count*order);
+            probs.reserve(count);
+            backoff_probs.reserve(count);
         }
+        int size() const { return probs.size(); }
+        const int* ngram(int i) const { return &words[(size_t)i*order]; }
+        int order;
+        std::vector<int> words;
+        std::vector<double> probs;
+        std::vector<double> backoff_probs;
     };
 
     int find_node(int node_idx, int word) const;
+    int find_compact_node(int node_idx, int word) const;
+    int find_hashed_node(int node_idx, int word) const {
+        if (node_idx == root_node)
+            return (word >= 0 && word < (int)unigram_nodes.size()) ? unigram_nodes[word] : -1;
+        unsigned long long hash_idx = arc_hash_index(node_idx, word);
+        while (true) {
+            const HashedArc &arc = arc_hash[hash_idx];
+            if (arc.node == node_idx && arc.word == word) return arc.target_node;
+            if (arc.node == -1) return -1;
+            hash_idx = (hash_idx+1) & arc_hash_mask;
+        }
+    }
+    unsigned long long arc_hash_index(int node_idx, int word) const {
+        unsigned long long key = ((unsigned long long)(unsigned int)node_idx << 32) | (unsigned int)word;
+        key *= 0x9E3779B97F4A7C15ULL;
+        return (key ^ (key >> 29)) & arc_hash_mask;
+    }
+    template <typename T> int score_quantized(int node_idx, int word, T &score) const;
+    // The codes take one byte up to 8 bits and two bytes above
+    int code_bytes() const { return quantization_bits <= 8 ? 1 : 2; }
+    // Bytes per node in node_codes: the order, the probability code and the backoff code
+    int code_stride() const { return 1 + 2*code_bytes(); }
+    int read_code(const unsigned char *code) const {
+        return quantization_bits <= 8 ? code[0] : (code[0] | (code[1] << 8));
+    }
+    float quantized_prob(int node_idx) const {
+        const unsigned char *codes = &node_codes[(size_t)node_idx*code_stride()];
+        return prob_codebook[(codes[0] << quantization_bits) + read_code(codes+1)];
+    }
+    float quantized_backoff_prob(int node_idx) const {
+        const unsigned char *codes = &node_codes[(size_t)node_idx*code_stride()];
+        return backoff_codebook[(codes[0] << quantization_bits) + read_code(codes+1+code_bytes())];
+    }
     int read_arpa_read_order(SimpleFileInput &arpafile,
-                             std::vector<NgramInfo> &order_ngrams,
+                             OrderNgrams &order_ngrams,
+                             std::unordered_map<std::string, int> &word_lookup,
                              std::string &line,
-                             int curr_ngram_order,
                              int &linei);
-    void read_arpa_insert_order_to_tree(std::vector<NgramInfo> &order_ngrams,
+    void read_arpa_sort_order(const OrderNgrams &order_ngrams,
+                              std::vector<int> &sorted_indices) const;
+    void read_arpa_insert_order_to_tree(const OrderNgrams &order_ngrams,
+                                        const std::vector<int> &sorted_indices,
                                         int &curr_node_idx,
-                                        int &curr_arc_idx,
-                                        int curr_order);
+                                        int &curr_arc_idx);
+
+    void set_symbols();
 
-    std::vector<Node> nodes;
-    std::vector<int> arc_words;
-    std::vector<int> arc_target_nodes;
+    NgramArray<Node> nodes;
+    NgramArray<int> arc_words;
+    NgramArray<int> arc_target_nodes;
     std::map<int, int> ngram_counts_per_order;
     int max_order;
+
+    // Quantized representation, used instead of the above arrays if set.
+    // The codebooks of all orders are in one array, 2^quantization_bits
+    // entries for each order.
+    NgramArray<CompactNode> compact_nodes;
+    NgramArray<unsigned char> node_codes;
+    std::vector<int> order_starts;
+    std::vector<float> prob_codebook;
+    std::vector<float> backoff_codebook;
+    int quantization_bits;
+
+    // Direct unigram table and arc hash table, used instead of binary search if set
+    std::vector<int> unigram_nodes;
+    std::vector<HashedArc> arc_hash;
+    unsigned long long arc_hash_mask;
+
+    std::shared_ptr<MemoryMappedFile> mapped_file;
 };
 
 class LNNgram : public Ngram {
 public:
     void read_arpa(std::string arpafname);
     void write_arpa(std::string arpafname);
-    void multiply_probs(double multiplier);
+    bool natural_log_probs() const { return true; }
+};
+
+
+/** Direct-mapped cache of n-gram transitions in front of Ngram::score.
+ *  Not thread-safe, use one cache per thread. A cache with zero
+ *  size bits passes all calls to the model. */
+class NgramCache {
+public:
+    NgramCache(const Ngram &lm, int size_bits=0);
+    int score(int node_idx, int word, double &score) {
+        if (m_entries.empty()) return m_lm->score(node_idx, word, score);
+        Entry &entry = m_entries[index(node_idx, word)];
+        if (entry.node == node_idx && entry.word == word) {
+            hits++;
+            score += entry.score;
+            return entry.next_node;
+        }
+        misses++;
+        entry.node = node_idx;
+        entry.word = word;
+        entry.score = 0.0;
+        entry.next_node = m_lm->score(node_idx, word, entry.score);
+        score += entry.score;
+        return entry.next_node;
+    }
+    int score(int node_idx, int word, float &score) {
+        double tmp = 0.0;
+        int next_node = this->score(node_idx, word, tmp);
+        score += tmp;
+        return next_node;
+    }
+    int advance(int node_idx, int word) { double tmp = 0.0; return score(node_idx, word, tmp); }
+    double hit_rate() const { return (hits+misses) > 0 ? double(hits)/double(hits+misses) : 0.0; }
+    void clear();
+
+    long int hits;
+    long int misses;
+
+private:
+    class Entry {
+    public:
+        int node;
+        int word;
+        int next_node;
+        double score;
+    };
+    unsigned int index(int node_idx, int word) const {
+        unsigned int key = (unsigned int)node_idx * 0x9E3779B1u ^ (unsigned int)word * 0x85EBCA6Bu;
+        return (key ^ (key >> 15)) & m_mask;
+    }
+    const Ngram *m_lm;
+    std::vector<Entry> m_entries;
+    unsigned int m_mask;
 };
 
 
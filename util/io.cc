@@ -1,25 +1,109 @@
 #include "io.hh"
 
+#include <algorithm>
 #include <cstring>
+#include <cstdio>
 
-#define GZIP_BUFFER_SIZE 102400
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define INPUT_BUFFER_SIZE 1048576
+#define OUTPUT_BUFFER_SIZE 1048576
+#define MULTI_MEMBER_PROBE_SIZE 67108864
+#define MAX_SEGMENT_CHUNKS 4
+#define LZ4_OUTPUT_BLOCK_SIZE 65536
 
 using namespace std;
 
 
-SimpleFileInput::SimpleFileInput(string filename)
+SimpleFileInput::SimpleFileInput(string filename,
+                                 bool background_decompression,
+                                 int decompression_threads)
+    : m_buffer(INPUT_BUFFER_SIZE), m_begin(0), m_scanned(0), m_end(0), m_eof(false)
 {
-    if (ends_with(filename, ".gz"))
+    string compression = input_compression(filename);
+
+    if (compression == "gzip")
     {
 #ifndef NO_ZLIB
+        if (decompression_threads <= 0)
+            decompression_threads = std::max(1u, std::thread::hardware_concurrency());
+        if (decompression_threads > 1 && filename != "-") {
+            // Only the beginning of the file is checked for other members,
+            // files which can not be mapped are read sequentially
+            shared_ptr<MemoryMappedFile> file;
+            try {
+                if (is_regular_file(filename)) file = make_shared<MemoryMappedFile>(filename);
+            } catch (string &e) { }
+            size_t probe_size = file ? std::min(file->size(), (size_t)MULTI_MEMBER_PROBE_SIZE) : 0;
+            if (file && ParallelGZipInput::find_member(file->data(), probe_size, 1) < probe_size) {
+                infs = new ParallelGZipInput(file, decompression_threads);
+                return;
+            }
+        }
         infs = new GZipFileInput(filename);
 #else
         cerr << "No ZLIB support" << endl;
         exit(1);
 #endif
     }
-    else
+    else if (compression == "zstd")
+    {
+#ifdef HAVE_ZSTD
+        infs = new ZstdFileInput(filename);
+#else
+        cerr << "No ZSTD support" << endl;
+        exit(1);
+#endif
+    }
+    else if (compression == "lz4")
+    {
+#ifdef HAVE_LZ4
+        infs = new Lz4FileInput(filename);
+#else
+        cerr << "No LZ4 support" << endl;
+        exit(1);
+#endif
+    }
+    else {
+#ifndef _WIN32
+        if (filename != "-" && is_regular_file(filename)) {
+            infs = NULL;
+            m_mapped = make_shared<MemoryMappedFile>(filename);
+            m_mapped->advise_sequential();
+            m_end = m_mapped->size();
+            vector<char>().swap(m_buffer);
+            return;
+        }
+#endif
         infs = new IFStreamInput(filename);
+        return;
+    }
+
+    if (background_decompression) infs = new BackgroundInput(infs);
+}
+
+string
+SimpleFileInput::input_compression(string filename)
+{
+    if (ends_with(filename, ".gz")) return "gzip";
+    if (ends_with(filename, ".zst")) return "zstd";
+    if (ends_with(filename, ".lz4")) return "lz4";
+    if (filename == "-" || !is_regular_file(filename)) return "";
+
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (fp == NULL) return "";
+    size_t num_read = fread(magic, 1, 4, fp);
+    fclose(fp);
+    if (num_read >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) return "gzip";
+    if (num_read == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) return "zstd";
+    if (num_read == 4 && magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4d && magic[3] == 0x18) return "lz4";
+    return "";
 }
 
 SimpleFileInput::~SimpleFileInput()
@@ -27,117 +111,611 @@ SimpleFileInput::~SimpleFileInput()
     if (infs) delete infs;
 }
 
+bool
+SimpleFileInput::is_regular_file(string filename)
+{
+#ifndef _WIN32
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+#else
+    return filename != "-";
+#endif
+}
+
+bool
+SimpleFileInput::getline(const char *&line, size_t &size)
+{
+    if (m_mapped) {
+        if (m_begin >= m_end) return false;
+        const char *begin = m_mapped->data() + m_begin;
+        const char *newline = (const char*)memchr(begin, '\n', m_end-m_begin);
+        const char *end = (newline != NULL) ? newline : m_mapped->data() + m_end;
+        m_begin = (newline != NULL) ? end - m_mapped->data() + 1 : m_end;
+        if (end > begin && *(end-1) == '\r') end--;
+        line = begin;
+        size = end-begin;
+        return true;
+    }
+
+    while (true) {
+        char *begin = m_buffer.data() + m_begin;
+        char *newline = (char*)memchr(m_buffer.data() + m_scanned, '\n', m_end-m_scanned);
+        if (newline != NULL || (m_eof && m_begin < m_end)) {
+            char *end = (newline != NULL) ? newline : m_buffer.data() + m_end;
+            m_begin = (newline != NULL) ? end - m_buffer.data() + 1 : m_end;
+            m_scanned = m_begin;
+            if (end > begin && *(end-1) == '\r') end--;
+            line = begin;
+            size = end-begin;
+            return true;
+        }
+        if (m_eof) return false;
+
+        // Move the partial line to the beginning and grow the buffer if it is full
+        m_scanned = m_end;
+        if (m_begin > 0) {
+            memmove(m_buffer.data(), begin, m_end-m_begin);
+            m_end -= m_begin;
+            m_scanned -= m_begin;
+            m_begin = 0;
+        }
+        if (m_end == m_buffer.size()) m_buffer.resize(2*m_buffer.size());
+        size_t num_read = infs->read(m_buffer.data() + m_end, m_buffer.size()-m_end);
+        if (num_read == 0) m_eof = true;
+        m_end += num_read;
+    }
+}
+
+BackgroundInput::BackgroundInput(FileInputType *input,
+                                 int num_buffers,
+                                 size_t buffer_size)
+    : m_input(input),
+      m_buffers(std::max(num_buffers, 2), vector<char>(buffer_size)),
+      m_sizes(m_buffers.size(), 0),
+      m_num_full(0),
+      m_read_idx(0),
+      m_read_pos(0),
+      m_eof(false),
+      m_stop(false)
+{
+    m_thread = thread(&BackgroundInput::read_ahead, this);
+}
+
+BackgroundInput::~BackgroundInput()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_buffer_empty.notify_one();
+    m_thread.join();
+    delete m_input;
+}
+
+void
+BackgroundInput::read_ahead()
+{
+    int write_idx = 0;
+    while (true) {
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_buffer_empty.wait(lock, [&]() { return m_num_full < (int)m_buffers.size() || m_stop; });
+            if (m_stop) return;
+        }
+
+        // The buffer is not touched by the consumer until it is marked full
+        size_t num_read = 0;
+        exception_ptr error;
+        try {
+            num_read = m_input->read(m_buffers[write_idx].data(), m_buffers[write_idx].size());
+        } catch (...) {
+            error = current_exception();
+        }
+
+        lock_guard<mutex> lock(m_mutex);
+        if (error || num_read == 0) {
+            m_error = error;
+            m_eof = true;
+            m_buffer_full.notify_one();
+            return;
+        }
+        m_sizes[write_idx] = num_read;
+        m_num_full++;
+        write_idx = (write_idx+1) % m_buffers.size();
+        m_buffer_full.notify_one();
+    }
+}
+
+size_t
+BackgroundInput::read(char *buffer, size_t size)
+{
+    unique_lock<mutex> lock(m_mutex);
+    m_buffer_full.wait(lock, [&]() { return m_num_full > 0 || m_eof; });
+    if (m_num_full == 0) {
+        if (m_error) rethrow_exception(m_error);
+        return 0;
+    }
+    lock.unlock();
+
+    size_t num_copied = std::min(size, m_sizes[m_read_idx]-m_read_pos);
+    memcpy(buffer, m_buffers[m_read_idx].data() + m_read_pos, num_copied);
+    m_read_pos += num_copied;
+    if (m_read_pos == m_sizes[m_read_idx]) {
+        m_read_pos = 0;
+        m_read_idx = (m_read_idx+1) % m_buffers.size();
+        lock.lock();
+        m_num_full--;
+        m_buffer_empty.notify_one();
+    }
+    return num_copied;
+}
+
+
 #ifndef NO_ZLIB
 GZipFileInput::GZipFileInput(string filename)
 {
     gzf = gzopen(filename.c_str(), "r");
+    if (gzf != NULL) gzbuffer(gzf, INPUT_BUFFER_SIZE);
 }
 
 GZipFileInput::~GZipFileInput()
 {
-    gzclose(gzf);
+    if (gzf != NULL) gzclose(gzf);
+}
+
+size_t
+GZipFileInput::read(char *buffer, size_t size)
+{
+    if (gzf == NULL) return 0;
+    size_t total = 0;
+    while (total < size) {
+        unsigned int chunk = (unsigned int)std::min(size-total, (size_t)1<<30);
+        int num_read = gzread(gzf, buffer+total, chunk);
+        if (num_read < 0) throw string("Problem reading compressed input");
+        if (num_read == 0) break;
+        total += num_read;
+    }
+    return total;
+}
+
+
+ParallelGZipInput::ParallelGZipInput(shared_ptr<MemoryMappedFile> file,
+                                     int num_threads,
+                                     size_t segment_size)
+    : m_file(file),
+      m_segment_size(std::max(segment_size, (size_t)1)),
+      m_max_segments_ahead(2*std::max(num_threads, 1)),
+      m_next_start(0),
+      m_read_segment(0),
+      m_read_pos(0),
+      m_stop(false)
+{
+    for (int i=0; i<std::max(num_threads, 1); i++)
+        m_threads.push_back(thread(&ParallelGZipInput::decompress_segments, this));
+}
+
+ParallelGZipInput::~ParallelGZipInput()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_space_ready.notify_all();
+    for (auto tit = m_threads.begin(); tit != m_threads.end(); ++tit)
+        tit->join();
+}
+
+size_t
+ParallelGZipInput::find_member(const char *data, size_t size, size_t pos)
+{
+    // Magic, deflate method, no reserved flags, valid extra flags
+    while (pos+10 <= size) {
+        const char *match = (const char*)memchr(data+pos, 0x1f, size-pos-9);
+        if (match == NULL) break;
+        const unsigned char *header = (const unsigned char*)match;
+        if (header[1] == 0x8b && header[2] == 8 && (header[3] & 0xe0) == 0
+            && (header[8] == 0 || header[8] == 2 || header[8] == 4))
+            return match-data;
+        pos = match-data+1;
+    }
+    return size;
+}
+
+void
+ParallelGZipInput::decompress_segments()
+{
+    while (true) {
+        shared_ptr<Segment> segment;
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_space_ready.wait(lock, [&]() {
+                return m_stop || m_next_start >= m_file->size()
+                    || (int)m_segments.size() < m_read_segment + m_max_segments_ahead;
+            });
+            if (m_stop || m_next_start >= m_file->size()) return;
+            size_t start = m_next_start;
+            size_t end = find_member(m_file->data(), m_file->size(),
+                                     std::min(start+m_segment_size, m_file->size()));
+            segment = make_shared<Segment>(m_segments.size(), start, end);
+            m_segments.push_back(segment);
+            m_next_start = end;
+        }
+
+        try {
+            decompress(*segment);
+        } catch (...) {
+            segment->error = current_exception();
+        }
+
+        lock_guard<mutex> lock(m_mutex);
+        segment->done = true;
+        m_data_ready.notify_all();
+    }
+}
+
+void
+ParallelGZipInput::decompress(Segment &segment)
+{
+    const char *data = m_file->data();
+    size_t size = m_file->size();
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 16+MAX_WBITS) != Z_OK)
+        throw string("Problem initializing decompression");
+
+    vector<char> chunk(INPUT_BUFFER_SIZE);
+    size_t chunk_used = 0;
+    size_t pos = segment.start;
+    size_t stop = segment.end;
+    while (true) {
+        zs.next_in = (Bytef*)(data+pos);
+        zs.avail_in = (uInt)std::min(size-pos, (size_t)1<<30);
+        zs.next_out = (Bytef*)(chunk.data()+chunk_used);
+        zs.avail_out = chunk.size()-chunk_used;
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        pos = (const char*)zs.next_in - data;
+        chunk_used = chunk.size()-zs.avail_out;
+
+        if (ret == Z_STREAM_END) {
+            inflateReset(&zs);
+            // Trailing data which is not another member is ignored
+            bool trailing_data = pos < size && find_member(data, std::min(size, pos+10), pos) != pos;
+            if (trailing_data || pos > stop) {
+                if (!end_file_after(segment)) break;
+                if (trailing_data) pos = size;
+                stop = size;
+            }
+            if (pos == stop) break;
+        }
+        else if (ret == Z_BUF_ERROR && zs.avail_in == 0) {
+            inflateEnd(&zs);
+            throw string("Truncated gzip input");
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            inflateEnd(&zs);
+            throw string("Problem decompressing gzip input");
+        }
+
+        if (chunk_used == chunk.size()) {
+            if (!push_chunk(segment, chunk)) {
+                inflateEnd(&zs);
+                return;
+            }
+            chunk.resize(INPUT_BUFFER_SIZE);
+            chunk_used = 0;
+        }
+    }
+    inflateEnd(&zs);
+
+    chunk.resize(chunk_used);
+    if (chunk_used > 0) push_chunk(segment, chunk);
 }
 
 bool
-GZipFileInput::getline(string &line)
+ParallelGZipInput::push_chunk(Segment &segment, vector<char> &chunk)
 {
-    char buffer[GZIP_BUFFER_SIZE];
-    char *res = gzgets(gzf, buffer, GZIP_BUFFER_SIZE-1);
-    if (res != NULL) {
-        strtok(buffer, "\r\n");
-        line.assign(buffer);
-        return true;
+    unique_lock<mutex> lock(m_mutex);
+    m_space_ready.wait(lock, [&]() {
+        return m_stop || segment.cancelled || segment.chunks.size() < MAX_SEGMENT_CHUNKS;
+    });
+    if (m_stop || segment.cancelled) return false;
+    segment.chunks.push_back(vector<char>());
+    segment.chunks.back().swap(chunk);
+    m_data_ready.notify_all();
+    return true;
+}
+
+bool
+ParallelGZipInput::end_file_after(Segment &segment)
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (segment.cancelled) return false;
+    segment.end = m_file->size();
+    m_next_start = m_file->size();
+    for (int i=segment.index+1; i<(int)m_segments.size(); i++)
+        m_segments[i]->cancelled = true;
+    m_segments.resize(segment.index+1);
+    m_space_ready.notify_all();
+    m_data_ready.notify_all();
+    return true;
+}
+
+size_t
+ParallelGZipInput::read(char *buffer, size_t size)
+{
+    unique_lock<mutex> lock(m_mutex);
+    while (true) {
+        m_data_ready.wait(lock, [&]() {
+            if (m_read_segment < (int)m_segments.size()) {
+                const Segment &segment = *m_segments[m_read_segment];
+                return segment.chunks.size() > 0 || segment.done;
+            }
+            return m_next_start >= m_file->size();
+        });
+        if (m_read_segment == (int)m_segments.size()) return 0;
+
+        Segment &segment = *m_segments[m_read_segment];
+        if (segment.chunks.size() > 0) {
+            // Workers only append chunks so the first one can be read unlocked
+            vector<char> &chunk = segment.chunks.front();
+            lock.unlock();
+            size_t num_copied = std::min(size, chunk.size()-m_read_pos);
+            memcpy(buffer, chunk.data()+m_read_pos, num_copied);
+            m_read_pos += num_copied;
+            lock.lock();
+            if (m_read_pos == chunk.size()) {
+                segment.chunks.pop_front();
+                m_read_pos = 0;
+                m_space_ready.notify_all();
+            }
+            return num_copied;
+        }
+
+        if (segment.error) rethrow_exception(segment.error);
+        m_segments[m_read_segment].reset();
+        m_read_segment++;
+        m_space_ready.notify_all();
     }
-    return false;
 }
 #endif
 
 
-SimpleFileOutput::SimpleFileOutput(string filename)
+MemoryMappedFile::MemoryMappedFile(string filename)
+    : m_data(NULL), m_size(0)
 {
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) throw string("Could not open file: " + filename);
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        ::close(fd);
+        throw string("Could not stat file: " + filename);
+    }
+    m_size = st.st_size;
+    if (m_size > 0) {
+        void *addr = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            ::close(fd);
+            throw string("Could not map file: " + filename);
+        }
+        m_data = static_cast<char*>(addr);
+    }
+    ::close(fd);
+#else
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (fp == NULL) throw string("Could not open file: " + filename);
+    fseek(fp, 0, SEEK_END);
+    m_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    m_data = new char[m_size];
+    if (fread(m_data, 1, m_size, fp) != m_size) {
+        fclose(fp);
+        delete[] m_data;
+        throw string("Could not read file: " + filename);
+    }
+    fclose(fp);
+#endif
+}
+
+void
+MemoryMappedFile::advise_sequential()
+{
+#ifndef _WIN32
+    if (m_data) madvise(m_data, m_size, MADV_SEQUENTIAL);
+#endif
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+#ifndef _WIN32
+    if (m_data) munmap(m_data, m_size);
+#else
+    delete[] m_data;
+#endif
+}
+
+
+SimpleFileOutput::SimpleFileOutput(string filename,
+                                   int compression_threads,
+                                   bool background_compression)
+{
+    m_buffer.reserve(BUFFER_SIZE + 4096);
     if (ends_with(filename, ".gz"))
     {
 #ifndef NO_ZLIB
         outfs = new GZipFileOutput(filename);
+        if (background_compression) outfs = new BackgroundOutput(outfs);
 #else
         cerr << "No ZLIB support" << endl;
         exit(1);
+#endif
+    }
+    else if (ends_with(filename, ".zst"))
+    {
+#ifdef HAVE_ZSTD
+        if (compression_threads <= 0)
+            compression_threads = std::max(1u, std::thread::hardware_concurrency());
+        outfs = new ZstdFileOutput(filename, compression_threads);
+#else
+        (void)compression_threads;
+        cerr << "No ZSTD support" << endl;
+        exit(1);
+#endif
+    }
+    else if (ends_with(filename, ".lz4"))
+    {
+#ifdef HAVE_LZ4
+        outfs = new Lz4FileOutput(filename);
+        if (background_compression) outfs = new BackgroundOutput(outfs);
+#else
+        cerr << "No LZ4 support" << endl;
+        exit(1);
 #endif
     }
     else
         outfs = new OFStream(filename);
 }
 
+bool
+SimpleFileOutput::supported(string filename)
+{
+#ifdef NO_ZLIB
+    if (ends_with(filename, ".gz")) return false;
+#endif
+#ifndef HAVE_ZSTD
+    if (ends_with(filename, ".zst")) return false;
+#endif
+#ifndef HAVE_LZ4
+    if (ends_with(filename, ".lz4")) return false;
+#endif
+    return true;
+}
+
 SimpleFileOutput::~SimpleFileOutput()
 {
-    close();
+    try {
+        close();
+    } catch (string &e) {
+        cerr << e << endl;
+    }
 }
 
 void
 SimpleFileOutput::close()
 {
     if (outfs) {
-        outfs->close();
-        delete outfs;
+        FileOutputType *output = outfs;
         outfs = NULL;
+        unique_ptr<FileOutputType> owned(output);
+        output->write(m_buffer.data(), m_buffer.size());
+        m_buffer.clear();
+        output->close();
     }
 }
 
-
-SimpleFileOutput&
-SimpleFileOutput::operator<<(const std::string &str)
+void
+SimpleFileOutput::flush_buffer()
 {
-    *outfs << str;
-    return *this;
+    outfs->write(m_buffer.data(), m_buffer.size());
+    m_buffer.clear();
 }
 
-SimpleFileOutput&
-SimpleFileOutput::operator<<(int intr)
-{
-    *outfs << intr;
-    return *this;
-}
 
-SimpleFileOutput&
-SimpleFileOutput::operator<<(long int lintr)
+BackgroundOutput::BackgroundOutput(FileOutputType *output,
+                                   int max_pending)
+    : m_output(output),
+      m_max_pending(std::max(max_pending, 1)),
+      m_closing(false)
 {
-    *outfs << lintr;
-    return *this;
+    m_thread = thread(&BackgroundOutput::write_behind, this);
 }
 
-
-SimpleFileOutput&
-SimpleFileOutput::operator<<(unsigned int uintr)
+BackgroundOutput::~BackgroundOutput()
 {
-    *outfs << uintr;
-    return *this;
+    try {
+        close();
+    } catch (string &e) {
+        cerr << e << endl;
+    }
 }
 
-SimpleFileOutput&
-SimpleFileOutput::operator<<(long unsigned int luintr)
+void
+BackgroundOutput::close()
 {
-    *outfs << luintr;
-    return *this;
+    if (m_output == NULL) return;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_closing = true;
+    }
+    m_buffer_ready.notify_one();
+    m_thread.join();
+    unique_ptr<FileOutputType> output(m_output);
+    m_output = NULL;
+    if (m_error) rethrow_exception(m_error);
+    output->close();
 }
 
-SimpleFileOutput&
-SimpleFileOutput::operator<<(float fltn)
-{
-    *outfs << fltn;
-    return *this;
+void
+BackgroundOutput::write(const char *data, size_t size)
+{
+    if (size == 0) return;
+    unique_lock<mutex> lock(m_mutex);
+    m_buffer_written.wait(lock, [&]() { return (int)m_pending.size() < m_max_pending || m_error; });
+    if (m_error) rethrow_exception(m_error);
+    string buffer;
+    if (m_free.size() > 0) {
+        buffer.swap(m_free.back());
+        m_free.pop_back();
+    }
+    lock.unlock();
+
+    // Blocks are copied so that the caller can reuse its buffer
+    buffer.assign(data, size);
+
+    lock.lock();
+    m_pending.push_back(string());
+    m_pending.back().swap(buffer);
+    m_buffer_ready.notify_one();
 }
 
-SimpleFileOutput&
-SimpleFileOutput::operator<<(double dfltn)
-{
-    *outfs << dfltn;
-    return *this;
+void
+BackgroundOutput::write_behind()
+{
+    string buffer;
+    while (true) {
+        {
+            unique_lock<mutex> lock(m_mutex);
+            if (buffer.capacity() > 0) {
+                m_free.push_back(string());
+                m_free.back().swap(buffer);
+                m_buffer_written.notify_one();
+            }
+            m_buffer_ready.wait(lock, [&]() { return m_pending.size() > 0 || m_closing; });
+            if (m_pending.empty()) return;
+            buffer.swap(m_pending.front());
+            m_pending.pop_front();
+        }
+
+        try {
+            m_output->write(buffer.data(), buffer.size());
+        } catch (...) {
+            lock_guard<mutex> lock(m_mutex);
+            m_error = current_exception();
+            m_pending.clear();
+            m_buffer_written.notify_one();
+            return;
+        }
+    }
 }
 
 
 OFStream::OFStream(string filename)
+    : out(&cout)
 {
+    if (filename == "-") return;
     ofstr.open(filename.c_str(), ios_base::out);
+    out = &ofstr;
 }
 
 OFStream::~OFStream()
@@ -148,130 +726,288 @@ OFStream::~OFStream()
 void
 OFStream::close()
 {
-    ofstr.close();
+    if (ofstr.is_open()) ofstr.close();
+    else out->flush();
 }
 
-OFStream&
-OFStream::operator<<(const std::string &str)
+void
+OFStream::write(const char *data, size_t size)
 {
-    ofstr << str;
-    return *this;
+    out->write(data, size);
 }
 
-OFStream&
-OFStream::operator<<(int intr)
-{
-    ofstr << intr;
-    return *this;
-}
 
-OFStream&
-OFStream::operator<<(long int lintr)
+#ifndef NO_ZLIB
+GZipFileOutput::GZipFileOutput(string filename)
 {
-    ofstr << lintr;
-    return *this;
+    gzf = gzopen(filename.c_str(), "w");
+    if (gzf == NULL) throw string("Could not open file: " + filename);
+    gzbuffer(gzf, OUTPUT_BUFFER_SIZE);
+    file_open = true;
 }
 
-
-OFStream&
-OFStream::operator<<(unsigned int uintr)
+GZipFileOutput::~GZipFileOutput()
 {
-    ofstr << uintr;
-    return *this;
+    try {
+        close();
+    } catch (string &e) {
+        cerr << e << endl;
+    }
 }
 
-OFStream&
-OFStream::operator<<(long unsigned int luintr)
+void
+GZipFileOutput::close()
 {
-    ofstr << luintr;
-    return *this;
+    if (!file_open) return;
+    // gzclose frees the stream also on errors
+    int ret = gzclose(gzf);
+    gzf = NULL;
+    file_open = false;
+    if (ret != Z_OK) throw string("Problem closing compressed output");
 }
 
-OFStream&
-OFStream::operator<<(float fltn)
-{
-    ofstr << fltn;
-    return *this;
+void
+GZipFileOutput::write(const char *data, size_t size)
+{
+    while (size > 0) {
+        unsigned int chunk = (unsigned int)std::min(size, (size_t)1<<30);
+        if (gzwrite(gzf, data, chunk) <= 0)
+            throw string("Problem writing compressed output");
+        data += chunk;
+        size -= chunk;
+    }
 }
+#endif
+
 
-OFStream&
-OFStream::operator<<(double dfltn)
+#ifdef HAVE_ZSTD
+ZstdFileInput::ZstdFileInput(string filename)
+    : m_input_eof(false), m_frame_done(true)
 {
-    ofstr << dfltn;
-    return *this;
+    m_fp = fopen(filename.c_str(), "rb");
+    if (m_fp == NULL) throw string("Could not open file: " + filename);
+    m_dstream = ZSTD_createDStream();
+    if (m_dstream == NULL) {
+        fclose(m_fp);
+        throw string("Problem initializing zstd decompression");
+    }
+    ZSTD_initDStream(m_dstream);
+    m_in_buffer.resize(std::max(ZSTD_DStreamInSize(), (size_t)INPUT_BUFFER_SIZE));
+    m_in.src = m_in_buffer.data();
+    m_in.size = 0;
+    m_in.pos = 0;
+}
+
+ZstdFileInput::~ZstdFileInput()
+{
+    ZSTD_freeDStream(m_dstream);
+    fclose(m_fp);
+}
+
+size_t
+ZstdFileInput::read(char *buffer, size_t size)
+{
+    while (true) {
+        if (m_in.pos == m_in.size && !m_input_eof) {
+            m_in.size = fread(m_in_buffer.data(), 1, m_in_buffer.size(), m_fp);
+            m_in.pos = 0;
+            if (m_in.size == 0) m_input_eof = true;
+        }
+
+        size_t in_pos = m_in.pos;
+        ZSTD_outBuffer out = { buffer, size, 0 };
+        size_t ret = ZSTD_decompressStream(m_dstream, &out, &m_in);
+        if (ZSTD_isError(ret))
+            throw string("Problem decompressing zstd input: ") + ZSTD_getErrorName(ret);
+        if (m_in.pos != in_pos || out.pos > 0) m_frame_done = (ret == 0);
+        if (out.pos > 0) return out.pos;
+        if (m_input_eof && m_in.pos == m_in.size) {
+            if (!m_frame_done) throw string("Truncated zstd input");
+            return 0;
+        }
+    }
 }
 
 
-#ifndef NO_ZLIB
-GZipFileOutput::GZipFileOutput(string filename)
+ZstdFileOutput::ZstdFileOutput(string filename, int num_threads, int level)
 {
-    gzf = gzopen(filename.c_str(), "w");
-    file_open = true;
+    m_fp = fopen(filename.c_str(), "wb");
+    if (m_fp == NULL) throw string("Could not open file: " + filename);
+    m_cctx = ZSTD_createCCtx();
+    if (m_cctx == NULL) {
+        fclose(m_fp);
+        throw string("Problem initializing zstd compression");
+    }
+    ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_compressionLevel, level);
+    // Fails without effect if the library is built without thread support
+    if (num_threads > 1) ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_nbWorkers, num_threads);
+    m_out_buffer.resize(ZSTD_CStreamOutSize());
 }
 
-GZipFileOutput::~GZipFileOutput()
+ZstdFileOutput::~ZstdFileOutput()
 {
-    close();
+    try {
+        close();
+    } catch (string &e) {
+        cerr << e << endl;
+    }
 }
 
 void
-GZipFileOutput::close()
+ZstdFileOutput::close()
+{
+    if (m_fp == NULL) return;
+    // The context and the file are released even if the frame can not be finished
+    string error;
+    try {
+        ZSTD_inBuffer in = { NULL, 0, 0 };
+        compress(in, ZSTD_e_end);
+    } catch (string &e) {
+        error = e;
+    }
+    ZSTD_freeCCtx(m_cctx);
+    m_cctx = NULL;
+    int ret = fclose(m_fp);
+    m_fp = NULL;
+    if (!error.empty()) throw error;
+    if (ret != 0) throw string("Problem closing zstd output");
+}
+
+void
+ZstdFileOutput::write(const char *data, size_t size)
 {
-    if (file_open) {
-         gzclose(gzf);
-         gzf = NULL;
+    ZSTD_inBuffer in = { data, size, 0 };
+    compress(in, ZSTD_e_continue);
+}
+
+void
+ZstdFileOutput::compress(ZSTD_inBuffer &in, ZSTD_EndDirective directive)
+{
+    while (true) {
+        ZSTD_outBuffer out = { m_out_buffer.data(), m_out_buffer.size(), 0 };
+        size_t remaining = ZSTD_compressStream2(m_cctx, &out, &in, directive);
+        if (ZSTD_isError(remaining))
+            throw string("Problem compressing zstd output: ") + ZSTD_getErrorName(remaining);
+        if (out.pos > 0 && fwrite(m_out_buffer.data(), 1, out.pos, m_fp) != out.pos)
+            throw string("Problem writing zstd output");
+        if (directive == ZSTD_e_end ? remaining == 0 : in.pos == in.size) return;
     }
-    file_open = false;
 }
+#endif
+
 
-GZipFileOutput&
-GZipFileOutput::operator<<(const std::string &str)
+#ifdef HAVE_LZ4
+Lz4FileInput::Lz4FileInput(string filename)
+    : m_in_buffer(INPUT_BUFFER_SIZE), m_in_pos(0), m_in_size(0), m_frame_done(true)
 {
-    gzprintf(gzf, "%s", str.c_str());
-    return *this;
+    m_fp = fopen(filename.c_str(), "rb");
+    if (m_fp == NULL) throw string("Could not open file: " + filename);
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&m_dctx, LZ4F_VERSION))) {
+        fclose(m_fp);
+        throw string("Problem initializing lz4 decompression");
+    }
 }
 
-GZipFileOutput&
-GZipFileOutput::operator<<(int intr)
+Lz4FileInput::~Lz4FileInput()
 {
-    gzprintf(gzf, "%d", intr);
-    return *this;
+    LZ4F_freeDecompressionContext(m_dctx);
+    fclose(m_fp);
 }
 
-GZipFileOutput&
-GZipFileOutput::operator<<(long int lintr)
+size_t
+Lz4FileInput::read(char *buffer, size_t size)
 {
-    gzprintf(gzf, "%ld", lintr);
-    return *this;
+    while (true) {
+        if (m_in_pos == m_in_size) {
+            m_in_size = fread(m_in_buffer.data(), 1, m_in_buffer.size(), m_fp);
+            m_in_pos = 0;
+        }
+
+        size_t out_size = size;
+        size_t in_size = m_in_size-m_in_pos;
+        size_t ret = LZ4F_decompress(m_dctx, buffer, &out_size,
+                                     m_in_buffer.data()+m_in_pos, &in_size, NULL);
+        if (LZ4F_isError(ret))
+            throw string("Problem decompressing lz4 input: ") + LZ4F_getErrorName(ret);
+        m_in_pos += in_size;
+        if (in_size > 0 || out_size > 0) m_frame_done = (ret == 0);
+        if (out_size > 0) return out_size;
+        if (m_in_size == 0) {
+            if (!m_frame_done) throw string("Truncated lz4 input");
+            return 0;
+        }
+    }
 }
 
 
-GZipFileOutput&
-GZipFileOutput::operator<<(unsigned int uintr)
+Lz4FileOutput::Lz4FileOutput(string filename)
+    : m_out_buffer(LZ4F_compressBound(LZ4_OUTPUT_BLOCK_SIZE, NULL))
 {
-    gzprintf(gzf, "%u", uintr);
-    return *this;
+    m_fp = fopen(filename.c_str(), "wb");
+    if (m_fp == NULL) throw string("Could not open file: " + filename);
+    if (LZ4F_isError(LZ4F_createCompressionContext(&m_cctx, LZ4F_VERSION))) {
+        fclose(m_fp);
+        throw string("Problem initializing lz4 compression");
+    }
+    size_t header_size = LZ4F_compressBegin(m_cctx, m_out_buffer.data(), m_out_buffer.size(), NULL);
+    try {
+        if (LZ4F_isError(header_size)) throw string("Problem initializing lz4 compression");
+        write_compressed(header_size);
+    } catch (...) {
+        LZ4F_freeCompressionContext(m_cctx);
+        fclose(m_fp);
+        throw;
+    }
 }
 
-GZipFileOutput&
-GZipFileOutput::operator<<(long unsigned int luintr)
+Lz4FileOutput::~Lz4FileOutput()
 {
-    gzprintf(gzf, "%lu", luintr);
-    return *this;
+    try {
+        close();
+    } catch (string &e) {
+        cerr << e << endl;
+    }
 }
 
-GZipFileOutput&
-GZipFileOutput::operator<<(float fltn)
-{
-    gzprintf(gzf, "%f", fltn);
-    return *this;
+void
+Lz4FileOutput::close()
+{
+    if (m_fp == NULL) return;
+    // The context and the file are released even if the frame can not be finished
+    string error;
+    try {
+        size_t size = LZ4F_compressEnd(m_cctx, m_out_buffer.data(), m_out_buffer.size(), NULL);
+        if (LZ4F_isError(size)) throw string("Problem compressing lz4 output");
+        write_compressed(size);
+    } catch (string &e) {
+        error = e;
+    }
+    LZ4F_freeCompressionContext(m_cctx);
+    m_cctx = NULL;
+    int ret = fclose(m_fp);
+    m_fp = NULL;
+    if (!error.empty()) throw error;
+    if (ret != 0) throw string("Problem closing lz4 output");
 }
 
-GZipFileOutput&
-GZipFileOutput::operator<<(double dfltn)
+void
+Lz4FileOutput::write(const char *data, size_t size)
+{
+    while (size > 0) {
+        size_t block_size = std::min(size, (size_t)LZ4_OUTPUT_BLOCK_SIZE);
+        size_t compressed_size = LZ4F_compressUpdate(m_cctx, m_out_buffer.data(), m_out_buffer.size(),
+                                                     data, block_size, NULL);
+        if (LZ4F_isError(compressed_size)) throw string("Problem compressing lz4 output");
+        write_compressed(compressed_size);
+        data += block_size;
+        size -= block_size;
+    }
+}
+
+void
+Lz4FileOutput::write_compressed(size_t size)
 {
-    gzprintf(gzf, "%f", dfltn);
-    return *this;
+    if (size > 0 && fwrite(m_out_buffer.data(), 1, size, m_fp) != size)
+        throw string("Problem writing lz4 output");
 }
 #endif
-
@@ -1,31 +1,53 @@
 #ifndef SIMPLE_IO
 #define SIMPLE_IO
 
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <string>
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "str.hh"
 
 #ifndef NO_ZLIB
 #include "zlib.h"
 #endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
 
 
+// Reads blocks of raw, possibly decompressed, bytes
 class FileInputType
 {
 public:
-    virtual bool getline(std::string &line) = 0;
+    virtual size_t read(char *buffer, size_t size) = 0;
     virtual ~FileInputType() { };
 };
 
+// Reads the standard input if the file name is "-"
 class IFStreamInput : public FileInputType
 {
 public:
-    IFStreamInput(std::string filename) { ifstr.open(filename.c_str(), std::ios_base::in); };
-    ~IFStreamInput() { ifstr.close(); }
-    bool getline(std::string &line) { return (bool)std::getline(ifstr, line); }
+    IFStreamInput(std::string filename) : in(&std::cin) {
+        if (filename == "-") return;
+        ifstr.open(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+        in = &ifstr;
+    };
+    ~IFStreamInput() { if (ifstr.is_open()) ifstr.close(); }
+    size_t read(char *buffer, size_t size) { in->read(buffer, size); return in->gcount(); }
 private:
     std::ifstream ifstr;
+    std::istream *in;
 };
 
 #ifndef NO_ZLIB
@@ -34,19 +56,134 @@ class GZipFileInput : public FileInputType
 public:
     GZipFileInput(std::string filename);
     ~GZipFileInput();
-    bool getline(std::string &line);
+    size_t read(char *buffer, size_t size);
 private:
     gzFile gzf;
 };
 #endif
 
+#ifdef HAVE_ZSTD
+// Decompresses zstd files, also several concatenated frames
+class ZstdFileInput : public FileInputType
+{
+public:
+    ZstdFileInput(std::string filename);
+    ~ZstdFileInput();
+    size_t read(char *buffer, size_t size);
+private:
+    ZstdFileInput(const ZstdFileInput&);
+    ZstdFileInput& operator=(const ZstdFileInput&);
+    FILE *m_fp;
+    ZSTD_DStream *m_dstream;
+    std::vector<char> m_in_buffer;
+    ZSTD_inBuffer m_in;
+    bool m_input_eof;
+    bool m_frame_done;
+};
+#endif
+
+#ifdef HAVE_LZ4
+// Decompresses lz4 frame format files, also several concatenated frames
+class Lz4FileInput : public FileInputType
+{
+public:
+    Lz4FileInput(std::string filename);
+    ~Lz4FileInput();
+    size_t read(char *buffer, size_t size);
+private:
+    Lz4FileInput(const Lz4FileInput&);
+    Lz4FileInput& operator=(const Lz4FileInput&);
+    FILE *m_fp;
+    LZ4F_dctx *m_dctx;
+    std::vector<char> m_in_buffer;
+    size_t m_in_pos;
+    size_t m_in_size;
+    bool m_frame_done;
+};
+#endif
+
+/** Maps a whole file read only to memory, the pages are shared with
+ *  other processes. The file must not be truncated while it is mapped,
+ *  reading a page past the new end of the file raises SIGBUS. */
+class MemoryMappedFile
+{
+public:
+    MemoryMappedFile(std::string filename);
+    ~MemoryMappedFile();
+    // Hints that the file will be read once from the beginning to the end
+    void advise_sequential();
+    char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+private:
+    MemoryMappedFile(const MemoryMappedFile&);
+    MemoryMappedFile& operator=(const MemoryMappedFile&);
+    char *m_data;
+    size_t m_size;
+};
+
+
+
+/** Reads blocks from another input ahead in a background thread to a
+ *  ring of buffers, so that decompression runs in parallel with the
+ *  processing of the lines. */
+class BackgroundInput : public FileInputType
+{
+public:
+    BackgroundInput(FileInputType *input,
+                    int num_buffers=3,
+                    size_t buffer_size=1048576);
+    ~BackgroundInput();
+    size_t read(char *buffer, size_t size);
+private:
+    BackgroundInput(const BackgroundInput&);
+    BackgroundInput& operator=(const BackgroundInput&);
+    void read_ahead();
+    FileInputType *m_input;
+    std::vector<std::vector<char> > m_buffers;
+    std::vector<size_t> m_sizes;
+    int m_num_full;
+    int m_read_idx;
+    size_t m_read_pos;
+    bool m_eof;
+    bool m_stop;
+    std::exception_ptr m_error;
+    std::mutex m_mutex;
+    std::condition_variable m_buffer_full;
+    std::condition_variable m_buffer_empty;
+    std::thread m_thread;
+};
+
+/** Reads lines from plain or gzipped files. The input is read in large
+ *  blocks to a buffer and lines are returned as spans to the buffer,
+ *  which grows as needed for long lines. Trailing carriage returns are
+ *  removed. Compressed files are decompressed in a background thread
+ *  unless background_decompression is false. Gzip files with multiple
+ *  members are decompressed in decompression_threads threads, by default
+ *  one per core. Uncompressed regular files are memory mapped and the
+ *  lines are returned directly from the mapping. The compression is
+ *  detected from the .gz, .zst and .lz4 suffixes or the magic bytes of
+ *  the file, zstd and lz4 support is enabled at build time. */
 class SimpleFileInput
 {
 public:
-    SimpleFileInput(std::string filename);
+    SimpleFileInput(std::string filename,
+                    bool background_decompression=true,
+                    int decompression_threads=0);
     ~SimpleFileInput();
-    bool getline(std::string &line) { return infs->getline(line); }
+    // The span is valid until the next call
+    bool getline(const char *&line, size_t &size);
+    bool getline(std::string &line) {
+        const char *data;
+        size_t size;
+        if (!getline(data, size)) return false;
+        line.assign(data, size);
+        return true;
+    }
+    static bool is_regular_file(std::string filename);
 private:
+    std::string input_compression(std::string filename);
+    SimpleFileInput(const SimpleFileInput&);
+    SimpleFileInput& operator=(const SimpleFileInput&);
     bool ends_with(std::string const &filename,
                    std::string const &suffix)
     {
@@ -54,39 +191,125 @@ private:
         return (0 == filename.compare(filename.length()-suffix.length(), suffix.length(), suffix));
     }
     FileInputType *infs;
+    std::shared_ptr<MemoryMappedFile> m_mapped;
+    std::vector<char> m_buffer;
+    size_t m_begin;
+    size_t m_scanned;
+    size_t m_end;
+    bool m_eof;
 };
 
 
+#ifndef NO_ZLIB
+/** Decompresses gzip files consisting of several members, for instance
+ *  concatenated gzip files, in multiple threads. The file is split to
+ *  segments at gzip headers which are decompressed in parallel and
+ *  returned in order. A boundary is confirmed when the preceding segment
+ *  ends exactly there, otherwise the header was a false match inside
+ *  compressed data and the rest of the file is decompressed sequentially. */
+class ParallelGZipInput : public FileInputType
+{
+public:
+    ParallelGZipInput(std::shared_ptr<MemoryMappedFile> file,
+                      int num_threads,
+                      size_t segment_size=4194304);
+    ~ParallelGZipInput();
+    size_t read(char *buffer, size_t size);
+    // Returns the position of the next possible gzip member at or after pos
+    static size_t find_member(const char *data, size_t size, size_t pos);
+private:
+    class Segment {
+    public:
+        Segment(int index, size_t start, size_t end)
+            : index(index), start(start), end(end), done(false), cancelled(false) { }
+        int index;
+        size_t start;
+        size_t end;
+        std::deque<std::vector<char> > chunks;
+        bool done;
+        bool cancelled;
+        std::exception_ptr error;
+    };
+    ParallelGZipInput(const ParallelGZipInput&);
+    ParallelGZipInput& operator=(const ParallelGZipInput&);
+    void decompress_segments();
+    void decompress(Segment &segment);
+    bool push_chunk(Segment &segment, std::vector<char> &chunk);
+    bool end_file_after(Segment &segment);
+    std::shared_ptr<MemoryMappedFile> m_file;
+    size_t m_segment_size;
+    int m_max_segments_ahead;
+    std::vector<std::shared_ptr<Segment> > m_segments;
+    size_t m_next_start;
+    int m_read_segment;
+    size_t m_read_pos;
+    bool m_stop;
+    std::mutex m_mutex;
+    std::condition_variable m_data_ready;
+    std::condition_variable m_space_ready;
+    std::vector<std::thread> m_threads;
+};
+#endif
+
 class FileOutputType
 {
 public:
     virtual void close() = 0;
-    virtual FileOutputType& operator<<(const std::string &str) = 0;
-    virtual FileOutputType& operator<<(int) = 0;
-    virtual FileOutputType& operator<<(long int) = 0;
-    virtual FileOutputType& operator<<(unsigned int) = 0;
-    virtual FileOutputType& operator<<(long unsigned int) = 0;
-    virtual FileOutputType& operator<<(float) = 0;
-    virtual FileOutputType& operator<<(double) = 0;
+    virtual void write(const char *data, size_t size) = 0;
     virtual ~FileOutputType() { };
 };
 
 
+#ifdef HAVE_ZSTD
+// Compresses to zstd, in multiple threads if supported by the library
+class ZstdFileOutput: public FileOutputType
+{
+public:
+    ZstdFileOutput(std::string filename, int num_threads=1, int level=3);
+    ~ZstdFileOutput();
+    void close();
+    void write(const char *data, size_t size);
+private:
+    ZstdFileOutput(const ZstdFileOutput&);
+    ZstdFileOutput& operator=(const ZstdFileOutput&);
+    void compress(ZSTD_inBuffer &in, ZSTD_EndDirective directive);
+    FILE *m_fp;
+    ZSTD_CCtx *m_cctx;
+    std::vector<char> m_out_buffer;
+};
+#endif
+
+
+#ifdef HAVE_LZ4
+class Lz4FileOutput: public FileOutputType
+{
+public:
+    Lz4FileOutput(std::string filename);
+    ~Lz4FileOutput();
+    void close();
+    void write(const char *data, size_t size);
+private:
+    Lz4FileOutput(const Lz4FileOutput&);
+    Lz4FileOutput& operator=(const Lz4FileOutput&);
+    void write_compressed(size_t size);
+    FILE *m_fp;
+    LZ4F_cctx *m_cctx;
+    std::vector<char> m_out_buffer;
+};
+#endif
+
+
+// Writes to the standard output if the file name is "-"
 class OFStream: public FileOutputType
 {
 public:
     OFStream(std::string filename);
     ~OFStream();
     void close();
-    OFStream& operator<<(const std::string &str);
-    OFStream& operator<<(int);
-    OFStream& operator<<(long int);
-    OFStream& operator<<(unsigned int);
-    OFStream& operator<<(long unsigned int);
-    OFStream& operator<<(float);
-    OFStream& operator<<(double);
+    void write(const char *data, size_t size);
 private:
     std::ofstream ofstr;
+    std::ostream *out;
 };
 
 
@@ -97,13 +320,7 @@ public:
     GZipFileOutput(std::string filename);
     ~GZipFileOutput();
     void close();
-    GZipFileOutput& operator<<(const std::string &str);
-    GZipFileOutput& operator<<(int);
-    GZipFileOutput& operator<<(long int);
-    GZipFileOutput& operator<<(unsigned int);
-    GZipFileOutput& operator<<(long unsigned int);
-    GZipFileOutput& operator<<(float);
-    GZipFileOutput& operator<<(double);
+    void write(const char *data, size_t size);
 private:
     gzFile gzf;
     bool file_open;
@@ -111,27 +328,94 @@ private:
 #endif
 
 
+// Writes blocks given by another thread so that compression
+// does not block formatting the output
+class BackgroundOutput : public FileOutputType
+{
+public:
+    BackgroundOutput(FileOutputType *output,
+                     int max_pending=3);
+    ~BackgroundOutput();
+    void close();
+    void write(const char *data, size_t size);
+private:
+    BackgroundOutput(const BackgroundOutput&);
+    BackgroundOutput& operator=(const BackgroundOutput&);
+    void write_behind();
+    FileOutputType *m_output;
+    std::deque<std::string> m_pending;
+    std::vector<std::string> m_free;
+    int m_max_pending;
+    bool m_closing;
+    std::exception_ptr m_error;
+    std::mutex m_mutex;
+    std::condition_variable m_buffer_ready;
+    std::condition_variable m_buffer_written;
+    std::thread m_thread;
+};
+
+
+/** Writes plain or compressed files, the compression is selected by the
+ *  .gz, .zst and .lz4 suffixes. zstd compression uses compression_threads
+ *  threads, by default one per core. The output is formatted to a buffer
+ *  which is passed on in large blocks, gzip and lz4 compression is done
+ *  in a background thread if background_compression is set. Floats are
+ *  written with the shortest representation which reads back to the
+ *  same value, doubles with six decimals as with printf's %f. */
 class SimpleFileOutput
 {
 public:
-    SimpleFileOutput(std::string filename);
+    SimpleFileOutput(std::string filename,
+                     int compression_threads=0,
+                     bool background_compression=true);
     ~SimpleFileOutput();
+    // False if the compression selected by the suffix is not built in
+    static bool supported(std::string filename);
     void close();
-    SimpleFileOutput& operator<<(const std::string &str);
-    SimpleFileOutput& operator<<(int);
-    SimpleFileOutput& operator<<(long int);
-    SimpleFileOutput& operator<<(unsigned int);
-    SimpleFileOutput& operator<<(long unsigned int);
-    SimpleFileOutput& operator<<(float);
-    SimpleFileOutput& operator<<(double);
+    void write(const char *data, size_t size) {
+        m_buffer.append(data, size);
+        if (m_buffer.size() >= BUFFER_SIZE) flush_buffer();
+    }
+    void write(const std::string &str) { write(str.data(), str.size()); }
+    SimpleFileOutput& operator<<(const std::string &str) { write(str.data(), str.size()); return *this; }
+    SimpleFileOutput& operator<<(const char *str) { write(str, strlen(str)); return *this; }
+    SimpleFileOutput& operator<<(int value) { return append_int(value); }
+    SimpleFileOutput& operator<<(long int value) { return append_int(value); }
+    SimpleFileOutput& operator<<(unsigned int value) { return append_uint(value); }
+    SimpleFileOutput& operator<<(long unsigned int value) { return append_uint(value); }
+    SimpleFileOutput& operator<<(float value) {
+        str::append_shortest(m_buffer, value);
+        if (m_buffer.size() >= BUFFER_SIZE) flush_buffer();
+        return *this;
+    }
+    SimpleFileOutput& operator<<(double value) {
+        str::append_double(m_buffer, value);
+        if (m_buffer.size() >= BUFFER_SIZE) flush_buffer();
+        return *this;
+    }
 private:
-    bool ends_with(std::string const &filename,
+    static const size_t BUFFER_SIZE = 1048576;
+    SimpleFileOutput(const SimpleFileOutput&);
+    SimpleFileOutput& operator=(const SimpleFileOutput&);
+    SimpleFileOutput& append_int(long int value) {
+        str::append_int(m_buffer, value);
+        if (m_buffer.size() >= BUFFER_SIZE) flush_buffer();
+        return *this;
+    }
+    SimpleFileOutput& append_uint(long unsigned int value) {
+        str::append_uint(m_buffer, value);
+        if (m_buffer.size() >= BUFFER_SIZE) flush_buffer();
+        return *this;
+    }
+    void flush_buffer();
+    static bool ends_with(std::string const &filename,
                    std::string const &suffix)
     {
         if (filename.length() < suffix.length()) return false;
         return (0 == filename.compare(filename.length()-suffix.length(), suffix.length(), suffix));
     }
     FileOutputType *outfs;
+    std::string m_buffer;
 };
 
 
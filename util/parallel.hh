@@ -0,0 +1,176 @@
+#ifndef PARALLEL_HH
+#define PARALLEL_HH
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "io.hh"
+
+
+/** Processes the lines of a file in batches.
+ *
+ * One thread reads batches of lines which are processed by worker
+ * threads. Each batch gets its own result which are added to the
+ * total in the input order with Result::add, so results which collect
+ * per line information keep the order of the input.
+ *
+ * \param infile = input file
+ * \param num_threads = number of worker threads, 1 processes in the calling thread
+ * \param process_batch = function(lines, batch result, thread index)
+ * \param total = the combined result
+ * \param batch_size = number of lines in a batch
+ * \param progress_interval = print the number of processed lines at this interval, 0 disables
+ */
+template <typename Result>
+void
+process_lines(SimpleFileInput &infile,
+              int num_threads,
+              std::function<void(const std::vector<std::string>&, Result&, int)> process_batch,
+              Result &total,
+              int batch_size=1000,
+              int progress_interval=0)
+{
+    long int lines_done = 0;
+    auto report_progress = [&](long int batch_lines) {
+        if (progress_interval > 0
+            && (lines_done+batch_lines)/progress_interval > lines_done/progress_interval)
+            std::cerr << "sentence " << (lines_done+batch_lines)/progress_interval*progress_interval << std::endl;
+        lines_done += batch_lines;
+    };
+
+    if (num_threads <= 1) {
+        std::vector<std::string> lines(batch_size);
+        while (true) {
+            int num_lines = 0;
+            while (num_lines < batch_size && infile.getline(lines[num_lines])) num_lines++;
+            if (num_lines == 0) break;
+            lines.resize(num_lines);
+            Result result;
+            process_batch(lines, result, 0);
+            total.add(result);
+            report_progress(num_lines);
+            if (num_lines < batch_size) break;
+        }
+        return;
+    }
+
+    std::mutex mtx;
+    std::condition_variable batch_ready, batch_taken, result_ready;
+    std::map<long int, std::vector<std::string> > batches;
+    std::map<long int, std::pair<Result, int> > results;
+    long int num_batches_read = 0;
+    long int next_batch = 0;
+    bool reading_done = false;
+    std::exception_ptr error;
+    int max_pending = 2*num_threads;
+
+    std::thread reader([&]() {
+        try {
+            while (true) {
+                std::vector<std::string> lines;
+                lines.reserve(batch_size);
+                std::string line;
+                while ((int)lines.size() < batch_size && infile.getline(line))
+                    lines.push_back(line);
+                int num_lines = lines.size();
+                std::unique_lock<std::mutex> lock(mtx);
+                if (num_lines > 0) {
+                    batch_taken.wait(lock, [&]() { return (int)batches.size() < max_pending || error; });
+                    if (error) return;
+                    batches[num_batches_read++].swap(lines);
+                }
+                if (num_lines < batch_size) {
+                    reading_done = true;
+                    batch_ready.notify_all();
+                    result_ready.notify_one();
+                    return;
+                }
+                batch_ready.notify_one();
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!error) error = std::current_exception();
+            batch_ready.notify_all();
+            result_ready.notify_one();
+        }
+    });
+
+    std::vector<std::thread> workers;
+    for (int t=0; t<num_threads; t++) {
+        workers.push_back(std::thread([&, t]() {
+            while (true) {
+                std::unique_lock<std::mutex> lock(mtx);
+                batch_ready.wait(lock, [&]() { return batches.size() > 0 || reading_done || error; });
+                if (batches.empty() || error) return;
+                long int batch_idx = batches.begin()->first;
+                std::vector<std::string> lines;
+                lines.swap(batches.begin()->second);
+                batches.erase(batches.begin());
+                batch_taken.notify_one();
+                lock.unlock();
+
+                Result result;
+                try {
+                    process_batch(lines, result, t);
+                } catch (...) {
+                    lock.lock();
+                    if (!error) error = std::current_exception();
+                    batch_taken.notify_all();
+                    batch_ready.notify_all();
+                    result_ready.notify_one();
+                    return;
+                }
+
+                lock.lock();
+                std::pair<Result, int> &batch_result = results[batch_idx];
+                std::swap(batch_result.first, result);
+                batch_result.second = lines.size();
+                result_ready.notify_one();
+            }
+        }));
+    }
+
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+        result_ready.wait(lock, [&]() {
+            return results.find(next_batch) != results.end()
+                || (reading_done && next_batch == num_batches_read)
+                || error;
+        });
+        if (error) break;
+        auto rit = results.find(next_batch);
+        if (rit == results.end()) break;
+        std::pair<Result, int> batch_result;
+        std::swap(batch_result, rit->second);
+        results.erase(rit);
+        lock.unlock();
+        try {
+            total.add(batch_result.first);
+            report_progress(batch_result.second);
+        } catch (...) {
+            lock.lock();
+            if (!error) error = std::current_exception();
+            batch_taken.notify_all();
+            batch_ready.notify_all();
+            break;
+        }
+        lock.lock();
+        next_batch++;
+    }
+    lock.unlock();
+
+    reader.join();
+    for (auto wit = workers.begin(); wit != workers.end(); ++wit)
+        wit->join();
+    if (error) std::rethrow_exception(error);
+}
+
+
+#endif /* PARALLEL_HH */
@@ -1,6 +1,7 @@
 #ifndef STR_HH
 #define STR_HH
 
+#include <algorithm>
 #include <cstddef> // NULL
 #include <cstring>
 #include <climits>
@@ -662,6 +663,115 @@ end_of_field:
         begin = tgt;
     }
 }
+
+/** Append an unsigned integer to a string without temporary allocations. */
+inline void
+append_uint(std::string &out, unsigned long int value)
+{
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    char *ptr = end;
+    do {
+        *--ptr = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    out.append(ptr, end-ptr);
+}
+
+/** Append an integer to a string without temporary allocations. */
+inline void
+append_int(std::string &out, long int value)
+{
+    if (value < 0) {
+        out += '-';
+        append_uint(out, 0UL-(unsigned long int)value);
+    }
+    else append_uint(out, value);
+}
+
+/** Append a non-negative integer scaled by 10^decimals as a decimal
+ * number, for example 1234 with 2 decimals as 12.34.
+ */
+inline void
+append_scaled(std::string &out, bool negative, unsigned long long int scaled, int decimals)
+{
+    char buf[48];
+    char *end = buf + sizeof(buf);
+    char *ptr = end;
+    if (decimals > 0) {
+        for (int i=0; i<decimals; i++) {
+            *--ptr = '0' + scaled % 10;
+            scaled /= 10;
+        }
+        *--ptr = '.';
+    }
+    do {
+        *--ptr = '0' + scaled % 10;
+        scaled /= 10;
+    } while (scaled > 0);
+    if (negative) *--ptr = '-';
+    out.append(ptr, end-ptr);
+}
+
+/** Append a floating point number with a fixed number of decimals
+ * to a string without temporary allocations. Very large values and
+ * non-finite values are formatted with snprintf().
+ * \param precision = number of decimals, at most 9
+ */
+inline void
+append_double(std::string &out, double value, int precision=6)
+{
+    static const double scales[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+    precision = std::max(0, std::min(precision, 9));
+    double abs_value = value < 0.0 ? -value : value;
+    if (!(abs_value * scales[precision] < 1e18)) {
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "%.*g", precision+10, value);
+        out.append(buf, len);
+        return;
+    }
+
+    unsigned long long int scaled = (unsigned long long int)(abs_value * scales[precision] + 0.5);
+    append_scaled(out, value < 0.0, scaled, precision);
+}
+
+/** Append the shortest decimal representation which reads back to
+ * the same float. Values of moderate magnitude are tried with an
+ * increasing number of decimals in integer arithmetic, a candidate
+ * is accepted directly if it is clearly closer to the value than to
+ * the neighbouring floats and otherwise checked with strtof().
+ */
+inline void
+append_shortest(std::string &out, float value)
+{
+    static const double scales[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+                                     1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+    float abs_float = value < 0.0f ? -value : value;
+    double abs_value = abs_float;
+    if (abs_value >= 1e-4 && abs_value < 1e9) {
+        double ulp = std::min((double)nextafterf(abs_float, FLT_MAX) - abs_value,
+                              abs_value - (double)nextafterf(abs_float, 0.0f));
+        for (int decimals=0; decimals<16; decimals++) {
+            double scaled_value = abs_value * scales[decimals];
+            if (scaled_value >= 1e15) break;
+            unsigned long long int scaled = (unsigned long long int)(scaled_value + 0.5);
+            double error = fabs((double)scaled / scales[decimals] - abs_value);
+            if (error > 0.5*ulp) continue;
+            size_t begin = out.size();
+            append_scaled(out, value < 0.0f, scaled, decimals);
+            if (error < 0.25*ulp || strtof(out.c_str()+begin, NULL) == value) return;
+            out.resize(begin);
+        }
+    }
+
+    char buf[32];
+    int len = 0;
+    for (int precision=6; precision<=9; precision++) {
+        len = snprintf(buf, sizeof(buf), "%.*g", precision, value);
+        if (strtof(buf, NULL) == value || value != value) break;
+    }
+    out.append(buf, len);
+}
 };
 
 #endif /* STR_HH */